@@ -0,0 +1,780 @@
+// Multi-board scaling benchmark. It drives 1 to 32 `HW` objects
+// against simulated IP-UCD boards (see host/ip-ucd-sim.h), whose
+// FIFOs are filled from a synthetic TCLK stream, and measures how
+// the driver's drain path scales: aggregate drained events per
+// second, the latency of the merged (time-ordered) stream and the
+// CPU used by the drain and merge threads. Each board count is run
+// twice, once with a drain thread per board and once with a single
+// thread draining every board. The shim's `IntLock`, like the one
+// on our uniprocessor targets, serializes register access across
+// boards.
+//
+// The `layout` mode instead measures how sensitive the drain path is
+// to false sharing: a drain thread updates per-entry state while a
+// monitoring thread, on another CPU, updates counters stored either
+// in the same cache line or in the next one. It first checks that
+// the groups of `HW` data members each start a cache line.
+//
+// The `align` mode feeds `TimestampAligner` events from several
+// boards in batches and fails if the mapped times stray outside
+// the matching window.
+//
+// The `wide` mode checks that verified `WideRegister` reads of a
+// simulated counter don't tear when it carries between the reads
+// of its two halves, as unverified ones do.
+//
+// The `replay` mode, in the bench-trace build, checks that bus
+// trace recording and replay reproduce the drains of a D16 board
+// and a D32 board with block transfers.
+//
+// Usage: bench [seconds per run] [events/s per board]
+//        bench layout [seconds per run]
+//        bench align [seconds per run]
+//        bench wide
+//        bench-trace replay
+
+#include "ip-ucd.h"
+#include "ip-ucd-sim.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace IPUCD::v1_0;
+
+namespace {
+
+    size_t const MAX_BOARDS = 32;
+    size_t const FIFO_DEPTH = 1024;
+    size_t const DRAIN_BATCH = 64;
+    long const POLL_NS = 100000;
+
+    // A critical section built on a pthread mutex. The boards and
+    // outputs are shared between the generator, drainers and
+    // merger.
+
+    class Guard {
+	pthread_mutex_t& mtx;
+
+     public:
+	explicit Guard(pthread_mutex_t& m) : mtx(m)
+	{
+	    pthread_mutex_lock(&mtx);
+	}
+
+	~Guard() { pthread_mutex_unlock(&mtx); }
+    };
+
+    void pause()
+    {
+	timespec const ts = { 0, POLL_NS };
+
+	nanosleep(&ts, 0);
+    }
+
+    Clock::Ticks threadCpu()
+    {
+	timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return Clock::Ticks(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+    }
+
+    struct Run;
+
+    // A simulated board and the driver instance for it. The
+    // generator fills the board's FIFO; `drain()` empties it
+    // through `HW::drain()` into the queue of events waiting for
+    // the merger. An event's `arrived` time is when the generator
+    // produced it, recovered from its stamp. `watermark` is the
+    // generator time up to which every event has been drained,
+    // which lets the merger release events in order.
+
+    struct Board {
+	IPUCD::sim::Fifo fifo;
+	HW* hw;
+
+	pthread_mutex_t outMtx;
+	std::vector<Event> out;
+	Clock::Ticks watermark;
+
+	Board(size_t const a16, size_t const a32) :
+	    fifo(a16, a32, FIFO_DEPTH), watermark(0)
+	{
+	    IPUCD::sim::installBoard(a16, a32);
+	    hw = new HW(a16, a32);
+	    pthread_mutex_init(&outMtx, 0);
+	}
+
+	~Board()
+	{
+	    delete hw;
+	    pthread_mutex_destroy(&outMtx);
+	}
+
+	size_t drain(Run const&);
+    };
+
+    struct Run {
+	size_t boards;
+	bool shared;
+	uint32_t rate;
+	std::vector<Board*> board;
+	bool volatile running;
+
+	// The generator's clock: stamps are microseconds since
+	// `start`. Every event stamped up to `generated` is in its
+	// board's FIFO.
+
+	Clock::Ticks start;
+	Clock::Ticks volatile generated;
+
+	// Results.
+
+	uint32_t drained;
+	Clock::Ticks drainCpu;
+	Clock::Ticks mergeCpu;
+	uint32_t misordered;
+	Histogram latency;
+	pthread_mutex_t resultMtx;
+    };
+
+    struct Drainer {
+	Run* run;
+	size_t first;
+	size_t count;
+    };
+
+    // Moves up to `DRAIN_BATCH` events from the board to the
+    // output queue. Returns the number moved. The generator's
+    // progress is read before draining: if the FIFO runs dry,
+    // everything produced up to then has been drained.
+
+    size_t Board::drain(Run const& run)
+    {
+	Event buf[DRAIN_BATCH];
+	Clock::Ticks const generated = run.generated;
+
+	__sync_synchronize();
+
+	size_t n;
+
+	{
+	    HW::LockType const lock(hw);
+
+	    n = hw->drain(lock, buf, DRAIN_BATCH);
+	}
+
+	Clock::Ticks const now = Clock::now();
+	uint32_t const us = Clock::toMicroseconds(now - run.start);
+
+	for (size_t ii = 0; ii < n; ++ii) {
+	    uint32_t const age = (us - buf[ii].entry.stamp()) & 0xffffff;
+
+	    buf[ii].arrived = run.start + Clock::fromMicroseconds(us - age);
+	    buf[ii].drained = now;
+	}
+
+	Guard const g(outMtx);
+
+	out.insert(out.end(), buf, buf + n);
+	watermark = std::max(watermark, n < DRAIN_BATCH ? generated :
+			     buf[n - 1].arrived - 1);
+	return n;
+    }
+
+    // Produces `rate` events per second per board. Every board
+    // sees the same TCLK events; the stamps are microseconds since
+    // the start of the run, like a board whose reset event never
+    // comes.
+
+    void* generate(void* const arg)
+    {
+	Run& run = *static_cast<Run*>(arg);
+	uint64_t made = 0;
+
+	while (run.running) {
+	    uint32_t const us = Clock::toMicroseconds(Clock::now() - run.start);
+	    uint64_t const due = uint64_t(us) * run.rate / 1000000u;
+
+	    for (; made < due; ++made) {
+		uint32_t const raw = ((us & 0xffffff) << 8) | uint8_t(made);
+
+		for (size_t ii = 0; ii < run.boards; ++ii)
+		    run.board[ii]->fifo.push(raw);
+	    }
+	    __sync_synchronize();
+	    run.generated = run.start + Clock::fromMicroseconds(us);
+	    pause();
+	}
+	return 0;
+    }
+
+    void* drain(void* const arg)
+    {
+	Drainer const& d = *static_cast<Drainer*>(arg);
+	Run& run = *d.run;
+	uint32_t total = 0;
+
+	while (run.running) {
+	    size_t n = 0;
+
+	    for (size_t ii = d.first; ii < d.first + d.count; ++ii)
+		n += run.board[ii]->drain(run);
+	    total += n;
+	    if (n == 0)
+		pause();
+	}
+
+	Clock::Ticks const cpu = threadCpu();
+	Guard const g(run.resultMtx);
+
+	run.drained += total;
+	run.drainCpu += cpu;
+	return 0;
+    }
+
+    struct Later {
+	bool operator()(Event const& a, Event const& b) const
+	{
+	    return a.arrived > b.arrived;
+	}
+    };
+
+    // Merges the boards' drained events into one stream ordered by
+    // production time. An event is released once every board's
+    // watermark has passed it, so no later drain can produce an
+    // earlier event. Its latency runs from production to release.
+
+    void* merge(void* const arg)
+    {
+	Run& run = *static_cast<Run*>(arg);
+	std::priority_queue<Event, std::vector<Event>, Later> heap;
+	std::vector<Event> tmp;
+	Clock::Ticks released = 0;
+
+	while (run.running) {
+	    Clock::Ticks mark = ~Clock::Ticks(0);
+
+	    for (size_t ii = 0; ii < run.boards; ++ii) {
+		Board& b = *run.board[ii];
+
+		{
+		    Guard const g(b.outMtx);
+
+		    tmp.swap(b.out);
+		    mark = std::min(mark, b.watermark);
+		}
+		for (size_t jj = 0; jj < tmp.size(); ++jj)
+		    heap.push(tmp[jj]);
+		tmp.clear();
+	    }
+
+	    Clock::Ticks const now = Clock::now();
+	    bool const idle = heap.empty() || heap.top().arrived > mark;
+
+	    while (!heap.empty() && heap.top().arrived <= mark) {
+		if (heap.top().arrived < released)
+		    ++run.misordered;
+		released = heap.top().arrived;
+		run.latency.record(Clock::toNanoseconds(now - heap.top().arrived));
+		heap.pop();
+	    }
+	    if (idle)
+		pause();
+	}
+	run.mergeCpu = threadCpu();
+	return 0;
+    }
+
+    // The state of the layout test. The drain thread owns `tuner`
+    // and `drained`, the monitoring thread owns `counters`. `Gap`
+    // bytes separate them: none puts them in one cache line, as
+    // happens when diagnostics sit next to drain state.
+
+    template <size_t Gap>
+    struct Layout {
+	ThresholdTuner tuner;
+	uint32_t volatile drained;
+	char gap[Gap];
+	uint32_t volatile counters[4];
+	bool volatile running;
+
+	Layout() : tuner(500, 64), drained(0), running(true)
+	{
+	    memset(const_cast<uint32_t*>(counters), 0, sizeof(counters));
+	}
+    } IPUCD_CACHE_ALIGNED;
+
+    // Puts the calling thread on `cpu`, when there's more than
+    // one.
+
+    void pin(long const cpu)
+    {
+#ifdef __linux__
+	if (sysconf(_SC_NPROCESSORS_ONLN) > cpu) {
+	    cpu_set_t set;
+
+	    CPU_ZERO(&set);
+	    CPU_SET(cpu, &set);
+	    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#else
+	(void) cpu;
+#endif
+    }
+
+    template <size_t Gap>
+    void* layoutDrain(void* const arg)
+    {
+	Layout<Gap>& l = *static_cast<Layout<Gap>*>(arg);
+	uint32_t stamp = 0;
+
+	pin(0);
+	while (l.running) {
+	    stamp += 7;
+	    l.tuner.observe(FifoEntry((stamp & 0xffffff) << 8));
+	    l.drained = l.drained + 1;
+	}
+	return 0;
+    }
+
+    template <size_t Gap>
+    void* layoutMonitor(void* const arg)
+    {
+	Layout<Gap>& l = *static_cast<Layout<Gap>*>(arg);
+
+	pin(1);
+	while (l.running)
+	    for (size_t ii = 0; ii < 4; ++ii)
+		l.counters[ii] = l.counters[ii] + 1;
+	return 0;
+    }
+
+    // Returns the drain thread's entries per second, optionally
+    // with the monitoring thread running.
+
+    template <size_t Gap>
+    double layoutRate(unsigned const duration, bool const monitor)
+    {
+	Layout<Gap> l;
+	pthread_t tid[2];
+	Clock::Ticks const start = Clock::now();
+
+	pthread_create(&tid[0], 0, layoutDrain<Gap>, &l);
+	if (monitor)
+	    pthread_create(&tid[1], 0, layoutMonitor<Gap>, &l);
+	sleep(duration);
+	l.running = false;
+	pthread_join(tid[0], 0);
+	if (monitor)
+	    pthread_join(tid[1], 0);
+
+	return l.drained / ((Clock::now() - start) / 1e9);
+    }
+
+    // Checks that the real `HW` object starts a cache line and
+    // so does each group of its data members, that the state the
+    // drain task touches per event sits in its group, and that
+    // the two ends of the interrupt queue are on separate lines.
+
+    bool hwLayout()
+    {
+	IPUCD::sim::installBoard(0x1000, 0x100000);
+
+	HW* const hw = new HW(0x1000, 0x100000);
+	HW::Layout const l = hw->layout();
+	size_t const misaligned =
+	    reinterpret_cast<uintptr_t>(hw) % IPUCD_CACHE_LINE +
+	    l.drain % IPUCD_CACHE_LINE + l.interrupt % IPUCD_CACHE_LINE +
+	    l.config % IPUCD_CACHE_LINE;
+	bool const drainGroup =
+	    l.tuner >= l.drain && l.tuner < l.interrupt &&
+	    l.triggers >= l.drain && l.triggers < l.interrupt;
+	bool const queueSplit =
+	    l.pendingHead >= l.interrupt && l.pendingTail < l.config &&
+	    l.pendingHead / IPUCD_CACHE_LINE != l.pendingTail / IPUCD_CACHE_LINE;
+
+	delete hw;
+	printf("HW: %u bytes; drain state at %u, interrupt state at %u,"
+	       " configuration at %u%s\n", unsigned(l.size),
+	       unsigned(l.drain), unsigned(l.interrupt), unsigned(l.config),
+	       misaligned ? " (MISALIGNED)" : "");
+	printf("tuner at %u, trigger shadow at %u%s; interrupt queue head"
+	       " at %u, tail at %u%s\n\n", unsigned(l.tuner),
+	       unsigned(l.triggers), drainGroup ? "" : " (NOT DRAIN STATE)",
+	       unsigned(l.pendingHead), unsigned(l.pendingTail),
+	       queueSplit ? "" : " (SHARED LINE)");
+	return misaligned == 0 && drainGroup && queueSplit;
+    }
+
+    bool layout(unsigned const duration)
+    {
+	printf("%u s per run, %ld CPUs, %d-byte cache lines; drain"
+	       " entries/s\n\n", duration, sysconf(_SC_NPROCESSORS_ONLN),
+	       IPUCD_CACHE_LINE);
+
+	bool const ok = hwLayout();
+
+	printf("%-20s %14s %14s %8s\n", "layout", "alone", "monitored",
+	       "ratio");
+
+	double const sharedAlone = layoutRate<0>(duration, false);
+	double const sharedBusy = layoutRate<0>(duration, true);
+	double const splitAlone = layoutRate<IPUCD_CACHE_LINE>(duration, false);
+	double const splitBusy = layoutRate<IPUCD_CACHE_LINE>(duration, true);
+
+	printf("%-20s %14.0f %14.0f %8.2f\n", "same cache line",
+	       sharedAlone, sharedBusy, sharedBusy / sharedAlone);
+	printf("%-20s %14.0f %14.0f %8.2f\n", "separate lines",
+	       splitAlone, splitBusy, splitBusy / splitAlone);
+	return ok;
+    }
+
+    // The `align` mode checks `TimestampAligner` against streams
+    // that are merged in batches, as a drain task does. Four
+    // events each repeat every 2 ms; board 0 is the reference,
+    // the others have their own offsets and drifts. Each board's
+    // events are fed `batch` at a time, round robin, so an event
+    // usually reaches the aligner after the reference has seen
+    // later repetitions of it. Once locked, every mapped time
+    // should be within the window of the true one and the loop
+    // shouldn't step.
+
+    size_t const ALIGN_BOARDS = 4;
+    int64_t const ALIGN_PERIOD = 2000;
+    int64_t const ALIGN_WARMUP = 100000;
+    uint32_t const ALIGN_WINDOW = 500;
+
+    bool alignRun(size_t const batch, unsigned const duration)
+    {
+	static int64_t const offset[ALIGN_BOARDS] = { 0, 1234, -3210, 17 };
+	static double const drift[ALIGN_BOARDS] = { 0, 50e-6, -20e-6, 5e-6 };
+
+	TimestampAligner al(ALIGN_BOARDS, ALIGN_WINDOW);
+	Clock::Ticks const host = Clock::now();
+	int64_t const end = int64_t(duration) * 1000000;
+	int64_t const step = ALIGN_PERIOD / 4;
+	int64_t origin = 0;
+	int64_t worst = 0;
+
+	for (int64_t t = 0; t < end; t += step * batch)
+	    for (size_t b = 0; b < ALIGN_BOARDS; ++b)
+		for (size_t ii = 0; ii < batch; ++ii) {
+		    int64_t const now = t + step * int64_t(ii);
+		    int64_t const local =
+			now + offset[b] + int64_t(now * drift[b]);
+		    Event ev;
+
+		    ev.entry = FifoEntry((uint32_t(local + 1000000) << 8) |
+					 uint8_t(now / step % 4));
+		    ev.arrived = host + now * 1000;
+
+		    int64_t const mapped = al.align(b, ev);
+
+		    if (t == 0 && b == 0 && ii == 0)
+			origin = mapped;
+		    int64_t const err = mapped - origin - now;
+
+		    if (now >= ALIGN_WARMUP)
+			worst = std::max(worst, err < 0 ? -err : err);
+		}
+
+	uint32_t steps = 0;
+	uint32_t matches = 0;
+
+	for (size_t b = 1; b < ALIGN_BOARDS; ++b) {
+	    TimestampAligner::Estimate const e = al.estimate(b);
+
+	    steps += e.steps;
+	    matches += e.matches;
+	}
+
+	bool const ok = worst <= int64_t(ALIGN_WINDOW) && steps == 0;
+
+	printf("%6u %10u %10lld %6u %s\n", unsigned(batch), matches,
+	       (long long) worst, steps, ok ? "ok" : "FAIL");
+	return ok;
+    }
+
+    bool align(unsigned const duration)
+    {
+	bool ok = true;
+
+	printf("%6s %10s %10s %6s\n", "batch", "matches", "max err us",
+	       "steps");
+	for (size_t batch = 1; batch <= 64; batch <<= 1)
+	    ok = alignRun(batch, duration) && ok;
+	return ok;
+    }
+
+    // The `wide` mode reads a simulated counter, which advances
+    // after every bus read, through `WideRegister`s with each word
+    // order and tear check. Reads start just below a carry out of
+    // the low word, so the carry lands between the two halves. A
+    // value the counter never held during the read is torn; the
+    // verified reads must have none, and the unverified ones must
+    // tear, or the check isn't reaching the carry.
+
+    size_t const WIDE_OFFSET = 0x300000;
+    size_t const WIDE_CARRIES = 256;
+
+    template <typename Reg>
+    uint32_t wideTears(IPUCD::sim::Counter& counter)
+    {
+	uint8_t volatile* const base =
+	    VME::hostWindow(VME::A32, WIDE_OFFSET, 0x2000);
+	uint32_t torn = 0;
+
+	for (uint32_t carry = 1; carry <= WIDE_CARRIES; ++carry)
+	    for (uint32_t below = 1; below <= 4; ++below) {
+		counter.set((carry << 16) - below);
+
+		uint32_t const before = counter.value();
+		uint32_t const v = Reg::read(base);
+
+		if (v < before || v >= counter.value())
+		    ++torn;
+	    }
+	return torn;
+    }
+
+    bool wide()
+    {
+	typedef WideRegister<VME::A32, uint32_t, 0x10, 0x12> HighFirst;
+	typedef WideRegister<VME::A32, uint32_t, 0x10, 0x12, VME::Read,
+			     HighWordFirst, Verified> HighFirstVerified;
+	typedef WideRegister<VME::A32, uint32_t, 0x10, 0x12, VME::Read,
+			     LowWordFirst> LowFirst;
+	typedef WideRegister<VME::A32, uint32_t, 0x10, 0x12, VME::Read,
+			     LowWordFirst, Verified> LowFirstVerified;
+
+	IPUCD::sim::Counter counter(WIDE_OFFSET, 0x10, 0x12);
+	uint32_t const reads = WIDE_CARRIES * 4;
+	uint32_t const hf = wideTears<HighFirst>(counter);
+	uint32_t const hfv = wideTears<HighFirstVerified>(counter);
+	uint32_t const lf = wideTears<LowFirst>(counter);
+	uint32_t const lfv = wideTears<LowFirstVerified>(counter);
+
+	printf("%-16s %10s %10s\n", "word order", "unverified", "verified");
+	printf("%-16s %10u %10u\n", "high first", hf, hfv);
+	printf("%-16s %10u %10u\n", "low first", lf, lfv);
+	printf("torn reads out of %u each: %s\n", reads,
+	       hf && lf && !hfv && !lfv ? "ok" : "FAIL");
+	return hf && lf && !hfv && !lfv;
+    }
+
+#ifdef IPUCD_BUS_TRACE
+    // The `replay` mode (in builds with `IPUCD_BUS_TRACE`) records
+    // the drains of a D16 board and of a D32 board with DMA block
+    // transfers, which leave the FIFOs empty, then replays the
+    // trace. The
+    // replayed drains have to deliver the recorded events with
+    // no mismatched or missing accesses.
+
+    size_t const REPLAY_EVENTS = 500;
+
+    size_t replayDrain(std::vector<Board*> const& board,
+		       std::vector<uint32_t>& out)
+    {
+	Event buf[DRAIN_BATCH];
+	size_t total = 0;
+
+	for (size_t ii = 0; ii < board.size(); ++ii) {
+	    size_t n;
+
+	    do {
+		HW::LockType const lock(board[ii]->hw);
+
+		n = board[ii]->hw->drain(lock, buf, DRAIN_BATCH);
+		for (size_t jj = 0; jj < n; ++jj)
+		    out.push_back(buf[jj].entry.raw());
+		total += n;
+	    } while (n == DRAIN_BATCH);
+	}
+	return total;
+    }
+
+    bool replay()
+    {
+	std::vector<Board*> board;
+
+	board.push_back(new Board(0x1000, 0x100000));
+	board.push_back(new Board(0x1100, 0x200000));
+
+	{
+	    HW& hw = *board[1]->hw;
+	    HW::LockType const lock(&hw);
+	    Capabilities caps = hw.getCapabilities();
+
+	    caps.fifo32 = caps.blockTransfer = true;
+	    hw.setCapabilities(lock, caps);
+	    hw.enableBlockDrain(lock, IPUCD::sim::Fifo::dma, &board[1]->fifo);
+	    hw.setFifoThreshold(lock, 16);
+	}
+
+	for (size_t ii = 0; ii < REPLAY_EVENTS; ++ii)
+	    for (size_t b = 0; b < board.size(); ++b)
+		board[b]->fifo.push(uint32_t(ii * 7) << 8 | uint8_t(ii));
+
+	std::vector<uint32_t> recorded, replayed;
+
+	BusTrace::startRecording(REPLAY_EVENTS * board.size() * 8);
+	replayDrain(board, recorded);
+	BusTrace::stop();
+
+	size_t const accesses = BusTrace::size();
+
+	BusTrace::startReplay();
+	replayDrain(board, replayed);
+	BusTrace::stop();
+
+	bool const ok = recorded.size() == REPLAY_EVENTS * board.size() &&
+	    replayed == recorded && BusTrace::mismatchCount() == 0 &&
+	    BusTrace::overrunCount() == 0;
+
+	printf("%u events, %u accesses recorded; replayed %u events,"
+	       " %u mismatches, %u overruns: %s\n",
+	       unsigned(recorded.size()), unsigned(accesses),
+	       unsigned(replayed.size()), BusTrace::mismatchCount(),
+	       BusTrace::overrunCount(), ok ? "ok" : "FAIL");
+	for (size_t ii = 0; ii < board.size(); ++ii)
+	    delete board[ii];
+	return ok;
+    }
+#endif
+
+    double seconds(timeval const& tv)
+    {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+
+    void measure(size_t const boards, bool const shared,
+		 unsigned const duration, uint32_t const rate)
+    {
+	Run run;
+
+	for (size_t ii = 0; ii < boards; ++ii)
+	    run.board.push_back(new Board(0x1000 + ii * 0x100,
+					  (ii + 1) * 0x100000));
+
+	run.boards = boards;
+	run.shared = shared;
+	run.rate = rate;
+	run.running = true;
+	run.drained = 0;
+	run.drainCpu = 0;
+	run.mergeCpu = 0;
+	run.misordered = 0;
+	pthread_mutex_init(&run.resultMtx, 0);
+
+	size_t const drainers = shared ? 1 : boards;
+	std::vector<Drainer> d(drainers);
+	std::vector<pthread_t> tid(drainers + 2);
+
+	for (size_t ii = 0; ii < drainers; ++ii) {
+	    d[ii].run = &run;
+	    d[ii].first = shared ? 0 : ii;
+	    d[ii].count = shared ? boards : 1;
+	}
+
+	Clock::Ticks const start = Clock::now();
+
+	run.start = start;
+	run.generated = start;
+	pthread_create(&tid[0], 0, generate, &run);
+	pthread_create(&tid[1], 0, merge, &run);
+	for (size_t ii = 0; ii < drainers; ++ii)
+	    pthread_create(&tid[ii + 2], 0, drain, &d[ii]);
+
+	sleep(duration);
+	run.running = false;
+	for (size_t ii = 0; ii < tid.size(); ++ii)
+	    pthread_join(tid[ii], 0);
+
+	double const wall = (Clock::now() - start) / 1e9;
+	uint32_t overflows = 0;
+
+	for (size_t ii = 0; ii < boards; ++ii)
+	    overflows += run.board[ii]->fifo.overflows();
+
+	printf("%6u %-9s %12.0f %9.1f %9.1f %9.1f %8.1f %8.1f %9u %9u\n",
+	       unsigned(boards), shared ? "shared" : "per-board",
+	       run.drained / wall, run.latency.percentile(50) / 1e3,
+	       run.latency.percentile(99) / 1e3, run.latency.max() / 1e3,
+	       100.0 * run.drainCpu / 1e9 / wall,
+	       100.0 * run.mergeCpu / 1e9 / wall, overflows, run.misordered);
+	pthread_mutex_destroy(&run.resultMtx);
+	for (size_t ii = 0; ii < boards; ++ii)
+	    delete run.board[ii];
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && !strcmp(argv[1], "layout")) {
+	unsigned const duration = argc > 2 ? atoi(argv[2]) : 2;
+
+	if (duration == 0) {
+	    fprintf(stderr, "usage: %s layout [seconds]\n", argv[0]);
+	    return 1;
+	}
+	return layout(duration) ? 0 : 1;
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "wide"))
+	return wide() ? 0 : 1;
+
+#ifdef IPUCD_BUS_TRACE
+    if (argc > 1 && !strcmp(argv[1], "replay"))
+	return replay() ? 0 : 1;
+#endif
+
+    if (argc > 1 && !strcmp(argv[1], "align")) {
+	unsigned const duration = argc > 2 ? atoi(argv[2]) : 2;
+
+	if (duration == 0) {
+	    fprintf(stderr, "usage: %s align [seconds]\n", argv[0]);
+	    return 1;
+	}
+	return align(duration) ? 0 : 1;
+    }
+
+    unsigned const duration = argc > 1 ? atoi(argv[1]) : 2;
+    uint32_t const rate = argc > 2 ? atoi(argv[2]) : 10000;
+    rusage before, after;
+
+    if (duration == 0 || rate == 0) {
+	fprintf(stderr, "usage: %s [seconds] [events/s per board]\n",
+		argv[0]);
+	return 1;
+    }
+
+    printf("%u s per run, %u events/s per board; latency is production"
+	   " to merged release\n(bucket upper bounds), CPU is percent of"
+	   " one core.\n\n", duration, rate);
+    printf("%6s %-9s %12s %9s %9s %9s %8s %8s %9s %9s\n", "boards",
+	   "drain", "events/s", "p50 us", "p99 us", "max us", "drain%",
+	   "merge%", "overflows", "misorder");
+
+    getrusage(RUSAGE_SELF, &before);
+    for (size_t n = 1; n <= MAX_BOARDS; n <<= 1) {
+	measure(n, false, duration, rate);
+	measure(n, true, duration, rate);
+    }
+    getrusage(RUSAGE_SELF, &after);
+
+    printf("\ntotal process CPU: %.1f s\n",
+	   seconds(after.ru_utime) - seconds(before.ru_utime) +
+	   seconds(after.ru_stime) - seconds(before.ru_stime));
+    return 0;
+}
+
+// Local variables:
+// mode: c++
+// End:
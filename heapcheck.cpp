@@ -0,0 +1,243 @@
+// Checks that the per-event paths don't touch the heap. It's built
+// with `IPUCD_HEAP_CHECK`, so the driver's scopes are live and
+// ip-ucd.cpp replaces the global `operator new`. Two simulated
+// boards (see host/ip-ucd-sim.h) are drained, one through the
+// D16 path and one through D32 and the block-transfer emulation,
+// with event timing, threshold tuning, trigger demultiplexing and
+// a trigger schedule turned on. Their events are dispatched to
+// handlers of every priority class and a coalescing subscription,
+// aligned and served to an `EventServer` client. Any allocation
+// made inside a scope is reported and makes the program fail.
+// Finally, a handler that allocates makes sure the check itself
+// works.
+//
+// Usage: heapcheck [rounds]
+
+#include "ip-ucd.h"
+#include "ip-ucd-sim.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace IPUCD::v1_0;
+
+namespace {
+
+    size_t const BOARDS = 2;
+    size_t const BATCH = 64;
+    size_t const EVENTS = 200;
+    char const SERVER_PATH[] = "/tmp/ipucd-heapcheck";
+
+    uint32_t reported = 0;
+
+    // Runs outside the scope, so it may allocate (and print).
+
+    void report(size_t const bytes)
+    {
+	if (reported++ < 8)
+	    fprintf(stderr, "heapcheck: %u-byte allocation on a per-event"
+		    " path\n", unsigned(bytes));
+    }
+
+    void handler(Event const&, void*)
+    {
+    }
+
+    int* volatile allocated;
+
+    void allocating(Event const&, void*)
+    {
+	allocated = new int(0);
+	delete allocated;
+    }
+
+    struct Board {
+	IPUCD::sim::Fifo fifo;
+	HW* hw;
+
+	Board(size_t const a16, size_t const a32) :
+	    fifo(a16, a32)
+	{
+	    IPUCD::sim::installBoard(a16, a32);
+	    hw = new HW(a16, a32);
+	}
+
+	~Board() { delete hw; }
+    };
+
+    // Connects a client to the event server. The server only
+    // accepts it on its next `poll()`.
+
+    int connectClient()
+    {
+	int const fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, SERVER_PATH);
+	if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr),
+			      sizeof(addr)) < 0) {
+	    perror("heapcheck: couldn't connect to the event server");
+	    exit(1);
+	}
+	return fd;
+    }
+
+    // Reads whatever the server sent, so its socket never fills
+    // up.
+
+    void discard(int const fd)
+    {
+	char buf[4096];
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+	    ;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    unsigned const rounds = argc > 1 ? atoi(argv[1]) : 1000;
+
+    if (rounds == 0) {
+	fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+	return 1;
+    }
+
+    // Everything is set up before the hook is installed; set-up
+    // is allowed to allocate.
+
+    Board* board[BOARDS];
+
+    for (size_t ii = 0; ii < BOARDS; ++ii)
+	board[ii] = new Board(0x1000 + ii * 0x100, (ii + 1) * 0x100000);
+
+    TriggerSchedule sched;
+
+    sched.add(100, 0x10, 1, true);
+    sched.add(5000, 0x10, 1, false);
+
+    for (size_t ii = 0; ii < BOARDS; ++ii) {
+	HW& hw = *board[ii]->hw;
+	HW::LockType const lock(&hw);
+
+	if (ii == 1) {
+	    Capabilities caps = hw.getCapabilities();
+
+	    caps.fifo32 = caps.blockTransfer = true;
+	    hw.setCapabilities(lock, caps);
+	    hw.enableBlockDrain(lock, 0, 0);
+	}
+	hw.setEventTiming(lock, true);
+	hw.enableThresholdTuning(lock, 1000);
+	hw.adjustTclkReception(lock, true, 0x02, 2);
+	hw.enableTriggerDemux(lock, 256);
+	hw.loadTriggerSchedule(lock, sched);
+    }
+
+    std::vector<int> const cpus(2, -1);
+    Executor exec(cpus);
+    EventSet coalesced;
+
+    coalesced.set(0x02);
+    coalesced.set(0x03);
+
+    CoalescingSubscription sub(coalesced);
+
+    for (size_t e = 0; e < 4; ++e) {
+	exec.subscribe(uint8_t(e), handler, 0, Executor::HardRealTime);
+	exec.subscribe(uint8_t(e), handler, 0, Executor::Soft);
+	exec.subscribe(uint8_t(e), handler, 0, Executor::Bulk);
+    }
+    exec.subscribe(0xff, allocating, 0, Executor::HardRealTime);
+    sub.attach(exec);
+
+    TimestampAligner aligner(BOARDS);
+    BroadcastRing ring(1024);
+    EventServer server(SERVER_PATH, ring, 16);
+    int const client = connectClient();
+
+    exec.start();
+    server.poll(0);
+    if (server.clientCount() != 1) {
+	fprintf(stderr, "heapcheck: the event server didn't accept"
+		" its client\n");
+	return 1;
+    }
+
+    HeapCheck::reset();
+    HeapCheck::setHook(report);
+
+    Event buf[BATCH];
+    Event coalescedBuf[256];
+    uint32_t stamp = 0;
+    uint32_t drained = 0;
+
+    for (unsigned r = 0; r < rounds; ++r) {
+	for (size_t ii = 0; ii < EVENTS; ++ii) {
+	    uint32_t const raw = ((stamp += 250) & 0xffffff) << 8 |
+		uint8_t(ii % 4);
+
+	    for (size_t b = 0; b < BOARDS; ++b)
+		board[b]->fifo.push(raw);
+	}
+
+	for (size_t b = 0; b < BOARDS; ++b) {
+	    size_t n;
+
+	    do {
+		{
+		    HW::LockType const lock(board[b]->hw);
+
+		    n = board[b]->hw->drain(lock, buf, BATCH);
+		}
+		drained += n;
+		exec.dispatch(buf, n);
+		for (size_t ii = 0; ii < n; ++ii) {
+		    aligner.align(b, buf[ii]);
+		    ring.publish(uint8_t(b), buf[ii]);
+		}
+	    } while (n == BATCH);
+	}
+	exec.flush();
+	sub.read(coalescedBuf);
+	server.poll(0);
+	discard(client);
+    }
+
+    uint32_t const violations = HeapCheck::violations();
+
+    printf("%u rounds, %u events drained: %u allocations on per-event"
+	   " paths\n", rounds, drained, violations);
+
+    // The allocating handler has to be caught, or the check
+    // isn't in effect.
+
+    Event probe;
+
+    HeapCheck::setHook(0);
+
+    probe.entry = FifoEntry(0xff);
+    exec.dispatch(&probe, 1);
+
+    bool const working = HeapCheck::violations() == violations + 1;
+
+    if (!working)
+	fprintf(stderr, "heapcheck: an allocating handler wasn't caught;"
+		" is IPUCD_HEAP_CHECK defined?\n");
+
+    exec.stop();
+    close(client);
+    for (size_t ii = 0; ii < BOARDS; ++ii)
+	delete board[ii];
+    return violations == 0 && drained == 2 * rounds * EVENTS && working ?
+	0 : 1;
+}
+
+// Local variables:
+// mode: c++
+// End:
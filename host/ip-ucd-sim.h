@@ -0,0 +1,202 @@
+// Helpers for driving `IPUCD::HW` against the host vwpp shim. The
+// shim's windows start zero-filled, which doesn't look like an
+// IP-UCD; `installBoard()` makes them look like an idle one and
+// `Fifo` models the board's event FIFO. `Counter` models a
+// free-running counter read as two 16-bit registers.
+
+#ifndef IP_UCD_SIM_H
+#define IP_UCD_SIM_H
+
+#include <vector>
+#include <vwpp-3.0.h>
+
+namespace IPUCD {
+    namespace sim {
+	using namespace vwpp::v3_0;
+
+	// Writes the IP ID PROM (manufacturer, model and `revision`)
+	// and an empty-FIFO status into the windows of a board at
+	// the given offsets.
+
+	inline void installBoard(size_t const a16Offset,
+				 size_t const a32Offset,
+				 uint8_t const revision = 0)
+	{
+	    uint8_t volatile* const a16 =
+		VME::hostWindow(VME::A16, a16Offset, 0x100);
+
+	    VME::hostWindow(VME::A32, a32Offset, 0x2000);
+	    a16[0x89] = 0xbb;
+	    a16[0x8b] = 0x15;
+	    a16[0x8d] = revision;
+	    VME::WriteAPI<uint16_t, 0x42, VME::Write>::writeMem(a16, 0, 0x0100);
+	}
+
+	// The FIFO of a board installed at the given offsets.
+	// Entries are queued with `push()`, from any thread, and
+	// read by the driver through the FIFO register: the high
+	// word is read first and reading the low word (or both,
+	// with D32) removes the entry. An empty FIFO reads as all
+	// ones. The status register's empty, threshold and full
+	// bits follow the contents; entries pushed to a full FIFO
+	// are counted and dropped.
+
+	class Fifo : public VME::HostDevice {
+	    enum { FIFO_REG = 0x1200, STATUS = 0x42, THRESHOLD = 0x4c };
+	    enum { EMPTY = 0x0100, AT_THRESHOLD = 0x0200, FULL = 0x0400 };
+
+	    uint8_t volatile* const a16;
+	    size_t const a32Offset;
+	    pthread_mutex_t mutex;
+	    std::vector<uint32_t> entry;
+	    size_t first;
+	    size_t count;
+	    uint32_t dropped;
+
+	    Fifo(Fifo const&);
+	    Fifo& operator=(Fifo const&);
+
+	    // Updates the status register. Called with `mutex` held.
+
+	    void status()
+	    {
+		typedef VME::ReadAPI<uint16_t, STATUS, VME::Read> Get;
+		typedef VME::WriteAPI<uint16_t, STATUS, VME::Write> Set;
+		typedef VME::ReadAPI<uint16_t, THRESHOLD, VME::Read> Threshold;
+
+		size_t const thr = Threshold::readMem(a16, 0);
+		uint16_t v = Get::readMem(a16, 0) & ~(EMPTY | AT_THRESHOLD | FULL);
+
+		if (count == 0)
+		    v |= EMPTY;
+		if (count >= (thr ? thr : 1))
+		    v |= AT_THRESHOLD;
+		if (count == entry.size())
+		    v |= FULL;
+		Set::writeMem(a16, 0, v);
+	    }
+
+	 public:
+	    Fifo(size_t const a16Offset, size_t const a32Offset,
+		 size_t const depth = 1024) :
+		a16(VME::hostWindow(VME::A16, a16Offset, 0x100)),
+		a32Offset(a32Offset), entry(depth), first(0), count(0),
+		dropped(0)
+	    {
+		pthread_mutex_init(&mutex, 0);
+		VME::attachHostDevice(VME::A32, a32Offset, 0x2000, this);
+	    }
+
+	    ~Fifo()
+	    {
+		VME::attachHostDevice(VME::A32, a32Offset, 0x2000, 0);
+		pthread_mutex_destroy(&mutex);
+	    }
+
+	    bool push(uint32_t const raw)
+	    {
+		pthread_mutex_lock(&mutex);
+
+		bool const room = count < entry.size();
+
+		if (room)
+		    entry[(first + count++) % entry.size()] = raw;
+		else
+		    ++dropped;
+		status();
+		pthread_mutex_unlock(&mutex);
+		return room;
+	    }
+
+	    uint32_t overflows() const { return dropped; }
+
+	    uint32_t read(size_t const offset, size_t const size)
+	    {
+		pthread_mutex_lock(&mutex);
+
+		uint32_t const v = count ? entry[first] : 0xffffffff;
+		bool const pop = count && (size == 4 || offset != FIFO_REG);
+
+		if (pop) {
+		    first = (first + 1) % entry.size();
+		    --count;
+		    status();
+		}
+		pthread_mutex_unlock(&mutex);
+
+		if (size == 4)
+		    return v;
+		return offset == FIFO_REG ? v >> 16 : v & 0xffff;
+	    }
+
+	    // Stands in for a carrier's DMA engine, as the block
+	    // read routine given to `HW::enableBlockDrain()` with the
+	    // `Fifo` as its context. Like real DMA, it reads the
+	    // entries without going through the register layer.
+
+	    static int dma(void* const ctx, uint32_t, uint32_t* const dst,
+			   size_t const n)
+	    {
+		Fifo* const fifo = static_cast<Fifo*>(ctx);
+
+		for (size_t ii = 0; ii < n; ++ii)
+		    dst[ii] = fifo->read(FIFO_REG, 4);
+		return int(n);
+	    }
+	};
+
+	// A 32-bit counter in the A32 window at `a32Offset`, read
+	// as two 16-bit registers at offsets `high` and `low`. It
+	// advances by one after every read of either half, so a
+	// carry out of the low word can land between the two reads
+	// of a `WideRegister`. `value()` is the current count.
+
+	class Counter : public VME::HostDevice {
+	    size_t const a32Offset;
+	    size_t const high;
+	    size_t const low;
+	    uint32_t count;
+
+	    Counter(Counter const&);
+	    Counter& operator=(Counter const&);
+
+	 public:
+	    Counter(size_t const a32Offset, size_t const high,
+		    size_t const low) :
+		a32Offset(a32Offset), high(high), low(low), count(0)
+	    {
+		VME::attachHostDevice(VME::A32, a32Offset, 0x2000, this);
+	    }
+
+	    ~Counter()
+	    {
+		VME::attachHostDevice(VME::A32, a32Offset, 0x2000, 0);
+	    }
+
+	    uint32_t value() const { return count; }
+	    void set(uint32_t const v) { count = v; }
+
+	    uint32_t read(size_t const offset, size_t const size)
+	    {
+		return peek(offset, size, 0);
+	    }
+
+	    uint32_t peek(size_t const offset, size_t, uint32_t const stored)
+	    {
+		uint32_t v = stored;
+
+		if (offset == high)
+		    v = count++ >> 16;
+		else if (offset == low)
+		    v = count++ & 0xffff;
+		return v;
+	    }
+	};
+    }
+}
+
+#endif
+
+// Local variables:
+// mode: c++
+// End:
@@ -0,0 +1,331 @@
+// A host implementation of the subset of vwpp-3.0 used by the
+// IP-UCD driver, so `libip-ucd.a` can be built and exercised on
+// Linux. Locks are pthread mutexes and VME windows are plain memory.
+//
+// `IntLock` takes a process-wide recursive mutex; a simulated
+// interrupt handler that takes it too is then serialized with
+// tasks holding a `PMLockWithInt`, as on our uniprocessor targets.
+//
+// The windows hold their contents big-endian, like the VME bus, so
+// a D32 read of two adjacent D16 registers gives the same value on
+// the host as on the crate. `VME::hostWindow()` gives simulators
+// access to a window's bytes, and `VME::attachHostDevice()` lets
+// them model registers, like FIFOs and counters, whose reads have
+// side effects.
+
+#ifndef VWPP_3_0_H
+#define VWPP_3_0_H
+
+#include <map>
+#include <stdexcept>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LIKELY(x) __builtin_expect(!!(x), 1)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+namespace vwpp {
+    namespace v3_0 {
+
+	class IntLock {
+	    IntLock(IntLock const&);
+	    IntLock& operator=(IntLock const&);
+
+	    static pthread_mutex_t* mutex()
+	    {
+		static pthread_mutex_t m = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+		return &m;
+	    }
+
+	 public:
+	    IntLock() { pthread_mutex_lock(mutex()); }
+	    ~IntLock() { pthread_mutex_unlock(mutex()); }
+	};
+
+	// Like VxWorks mutex semaphores, these may be taken again by
+	// the task which holds them.
+
+	class Mutex {
+	    pthread_mutex_t m;
+
+	    Mutex(Mutex const&);
+	    Mutex& operator=(Mutex const&);
+
+	 public:
+	    Mutex()
+	    {
+		pthread_mutexattr_t attr;
+
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&m, &attr);
+		pthread_mutexattr_destroy(&attr);
+	    }
+
+	    ~Mutex() { pthread_mutex_destroy(&m); }
+
+	    void acquire() { pthread_mutex_lock(&m); }
+	    void release() { pthread_mutex_unlock(&m); }
+
+	    class Lock {
+		Mutex* const mtx;
+
+		Lock(Lock const&);
+		Lock& operator=(Lock const&);
+
+	     public:
+		explicit Lock(Mutex* const m) : mtx(m) { mtx->acquire(); }
+		~Lock() { mtx->release(); }
+	    };
+
+	    template <class T, Mutex T::*PMtx>
+	    class PMLock {
+		T* const obj;
+
+		PMLock(PMLock const&);
+		PMLock& operator=(PMLock const&);
+
+	     public:
+		explicit PMLock(T* const o) : obj(o) { (obj->*PMtx).acquire(); }
+		~PMLock() { (obj->*PMtx).release(); }
+	    };
+
+	    // The mutex is taken before interrupts are locked (bases
+	    // are constructed in order), so a task waiting for the
+	    // mutex never holds off the interrupt handler.
+
+	    template <class T, Mutex T::*PMtx>
+	    class PMLockWithInt : private PMLock<T, PMtx>, public IntLock {
+	     public:
+		explicit PMLockWithInt(T* const o) : PMLock<T, PMtx>(o) {}
+	    };
+	};
+
+	namespace VME {
+
+	    enum AddressSpace { A16, A24, A32 };
+	    enum DataAccess { D8, D16, D8_D16, D32, D16_D32 };
+	    enum ReadAccess { NoRead, Read, DestructiveRead };
+	    enum WriteAccess { NoWrite, Write, ConfirmWrite };
+
+	    // A simulated device behind a window. Destructive reads
+	    // go to it instead of the window's memory. `read()` gets
+	    // the byte offset in the window and the access width and
+	    // returns the value read. Plain reads come from memory,
+	    // but are passed through `peek()` first, so a device can
+	    // model registers that change as they're read.
+
+	    class HostDevice {
+	     public:
+		virtual ~HostDevice() {}
+		virtual uint32_t read(size_t offset, size_t size) = 0;
+
+		virtual uint32_t peek(size_t, size_t, uint32_t const stored)
+		{
+		    return stored;
+		}
+	    };
+
+	    // Each window is preceded by a header holding its device,
+	    // so a device read finds it without a lookup.
+
+	    size_t const HOST_HEADER = 16;
+
+	    inline HostDevice*& hostDevice(uint8_t volatile* const base)
+	    {
+		return *reinterpret_cast<HostDevice**>(
+		    const_cast<uint8_t*>(base) - HOST_HEADER);
+	    }
+
+	    // A big-endian load of `T` from a window's memory.
+
+	    template <typename T>
+	    inline T hostLoad(uint8_t volatile* const p)
+	    {
+		T value = 0;
+
+		for (size_t ii = 0; ii < sizeof(T); ++ii)
+		    value = T((value << 8) | p[ii]);
+		return value;
+	    }
+
+	    // Big-endian loads and stores of `T` at `base + Offset`,
+	    // indexed by element.
+
+	    template <typename T, size_t Offset, ReadAccess R>
+	    struct ReadAPI {
+		static T readMem(uint8_t volatile* const base, size_t const idx)
+		{
+		    size_t const offset = Offset + idx * sizeof(T);
+		    T const value = hostLoad<T>(base + offset);
+		    HostDevice* const dev = hostDevice(base);
+
+		    if (dev)
+			return T(dev->peek(offset, sizeof(T), value));
+		    return value;
+		}
+	    };
+
+	    template <typename T, size_t Offset>
+	    struct ReadAPI<T, Offset, NoRead> {};
+
+	    template <typename T, size_t Offset>
+	    struct ReadAPI<T, Offset, DestructiveRead> {
+		static T readMem(uint8_t volatile* const base, size_t const idx)
+		{
+		    size_t const offset = Offset + idx * sizeof(T);
+		    HostDevice* const dev = hostDevice(base);
+
+		    if (dev)
+			return T(dev->read(offset, sizeof(T)));
+		    return hostLoad<T>(base + offset);
+		}
+	    };
+
+	    template <typename T, size_t Offset, WriteAccess W>
+	    struct WriteAPI {
+		static void writeMem(uint8_t volatile* const base, size_t const idx,
+				     T value)
+		{
+		    uint8_t volatile* const p = base + Offset + idx * sizeof(T);
+
+		    for (size_t ii = sizeof(T); ii-- > 0; value = T(value >> 8))
+			p[ii] = uint8_t(value);
+		}
+	    };
+
+	    template <typename T, size_t Offset>
+	    struct WriteAPI<T, Offset, NoWrite> {};
+
+	    template <AddressSpace S, typename T, size_t Offset, ReadAccess R,
+		      WriteAccess W>
+	    struct Register {
+		typedef T Type;
+		typedef T AtomicType;
+
+		static AddressSpace const space = S;
+
+		enum { RegOffset = Offset, RegEntries = 1 };
+
+		static Type read(uint8_t volatile* const base)
+		{
+		    return ReadAPI<T, Offset, R>::readMem(base, 0);
+		}
+
+		static void write(uint8_t volatile* const base, Type const v)
+		{
+		    WriteAPI<T, Offset, W>::writeMem(base, 0, v);
+		}
+	    };
+
+	    template <AddressSpace S, typename T, size_t N, size_t Offset,
+		      ReadAccess R, WriteAccess W>
+	    struct Register<S, T[N], Offset, R, W> {
+		typedef T Type;
+		typedef T AtomicType;
+
+		static AddressSpace const space = S;
+
+		enum { RegOffset = Offset, RegEntries = N };
+
+		static Type readElement(uint8_t volatile* const base,
+					size_t const idx)
+		{
+		    return ReadAPI<T, Offset, R>::readMem(base, idx);
+		}
+
+		static void writeElement(uint8_t volatile* const base,
+					 size_t const idx, Type const v)
+		{
+		    WriteAPI<T, Offset, W>::writeMem(base, idx, v);
+		}
+	    };
+
+	    // Returns the simulated window at `offset` in address
+	    // space `space`, creating it (zero-filled) the first time.
+	    // Every `Memory` at the same location shares the window.
+	    // Windows are never freed.
+
+	    inline uint8_t volatile* hostWindow(AddressSpace const space,
+						size_t const offset,
+						size_t const size)
+	    {
+		typedef std::pair<int, size_t> Key;
+		typedef std::pair<uint8_t*, size_t> Window;
+
+		static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+		static std::map<Key, Window> windows;
+
+		pthread_mutex_lock(&m);
+
+		Window& w = windows[Key(space, offset)];
+
+		if (!w.first) {
+		    w.first = new uint8_t[HOST_HEADER + size]() + HOST_HEADER;
+		    w.second = size;
+		}
+
+		bool const fits = size <= w.second;
+
+		pthread_mutex_unlock(&m);
+		if (!fits)
+		    throw std::logic_error("VME window overlaps a smaller one");
+		return w.first;
+	    }
+
+	    // Routes the reads of a window to `dev` (or, if it's
+	    // null, back to memory).
+
+	    inline void attachHostDevice(AddressSpace const space,
+					 size_t const offset, size_t const size,
+					 HostDevice* const dev)
+	    {
+		hostDevice(hostWindow(space, offset, size)) = dev;
+	    }
+
+	    template <AddressSpace S, DataAccess D, size_t Size, typename Lock>
+	    class Memory {
+		uint8_t volatile* const base;
+
+	     public:
+		explicit Memory(size_t const offset) :
+		    base(hostWindow(S, offset, Size))
+		{
+		}
+
+		template <typename R>
+		typename R::Type get(Lock const&) const
+		{
+		    return R::read(base);
+		}
+
+		template <typename R>
+		void set(Lock const&, typename R::Type const v) const
+		{
+		    R::write(base, v);
+		}
+
+		template <typename R>
+		typename R::Type get_element(Lock const&, size_t const idx) const
+		{
+		    return R::readElement(base, idx);
+		}
+
+		template <typename R>
+		void set_element(Lock const&, size_t const idx,
+				 typename R::Type const v) const
+		{
+		    R::writeElement(base, idx, v);
+		}
+	    };
+	}
+    }
+}
+
+#endif
+
+// Local variables:
+// mode: c++
+// End:
@@ -1 +1,2035 @@
 #include "ip-ucd.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#ifdef __vxworks
+#include <intLib.h>
+#include <iv.h>
+#include <memLib.h>
+#include <sysLib.h>
+#include <taskLib.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace IPUCD {
+    namespace v1_0 {
+
+	uint32_t Histogram::percentile(unsigned const pct) const
+	{
+	    uint64_t const goal = (uint64_t(total) * pct + 99) / 100;
+	    uint64_t seen = 0;
+
+	    for (size_t ii = 0; ii < BUCKETS; ++ii)
+		if ((seen += bucket[ii]) >= goal && seen > 0)
+		    return ii ? (ii < 32 ? (1u << ii) - 1 : 0xffffffff) : 0;
+	    return 0;
+	}
+
+	// Prints a summary line followed by the non-empty
+	// buckets, labelled with their upper bounds.
+
+	void Histogram::dump(char const* const label,
+			     char const* const units) const
+	{
+	    printf("%-22s n=%u min=%u mean=%u p99<=%u max=%u (%s)\n",
+		   label, total, min(), mean(), percentile(99), high,
+		   units);
+
+	    for (size_t ii = 0; ii < BUCKETS; ++ii)
+		if (bucket[ii])
+		    printf("    < %10u: %u\n",
+			   ii < 32 ? 1u << ii : 0xffffffff, bucket[ii]);
+	}
+
+	static void apply(uint16_t* const table, uint8_t const event,
+			  uint16_t const mask, bool const enable)
+	{
+	    table[event] = enable ? (table[event] | mask) :
+		(table[event] & ~mask);
+	}
+
+	// Deltas sharing an offset are applied together, in the
+	// order they were added, and only the entries whose final
+	// value differs from the previous one are written.
+
+	void TriggerSchedule::compile(uint16_t const* const base,
+				      std::vector<Write>& start)
+	{
+	    size_t const N = 256;
+	    std::vector<Delta> d(deltas);
+	    std::vector<Write> body;
+	    uint16_t table[N], first[N], prev[N];
+	    size_t ii = 0;
+
+	    std::stable_sort(d.begin(), d.end());
+	    std::copy(base, base + N, table);
+
+	    while (ii < d.size() && d[ii].offset == 0) {
+		apply(table, d[ii].event, d[ii].mask, d[ii].enable);
+		++ii;
+	    }
+
+	    start.clear();
+	    for (size_t ev = 0; ev < N; ++ev)
+		if (table[ev] != base[ev]) {
+		    Write const w = { 0, table[ev], uint8_t(ev) };
+
+		    start.push_back(w);
+		}
+	    std::copy(table, table + N, first);
+
+	    while (ii < d.size()) {
+		uint32_t const offset = d[ii].offset;
+		size_t const from = ii;
+
+		std::copy(table, table + N, prev);
+		for (; ii < d.size() && d[ii].offset == offset; ++ii)
+		    apply(table, d[ii].event, d[ii].mask, d[ii].enable);
+
+		for (size_t jj = from; jj < ii; ++jj) {
+		    uint8_t const ev = d[jj].event;
+
+		    if (table[ev] != prev[ev]) {
+			Write const w = { offset, table[ev], ev };
+
+			body.push_back(w);
+			prev[ev] = table[ev];
+		    }
+		}
+	    }
+
+	    // At each supercycle reset, put back the entries the
+	    // cycle changed.
+
+	    writes.clear();
+	    for (size_t ev = 0; ev < N; ++ev)
+		if (table[ev] != first[ev]) {
+		    Write const w = { 0, first[ev], uint8_t(ev) };
+
+		    writes.push_back(w);
+		}
+	    restore = writes.size();
+	    writes.insert(writes.end(), body.begin(), body.end());
+	    rewind();
+	}
+
+	// Loop gains, as shifts: the offset takes 1/8 of each error
+	// and the drift 1/64 of the error rate.
+
+	static unsigned const ALIGN_ALPHA = 3;
+	static unsigned const ALIGN_BETA = 6;
+
+	// Occurrences this many windows apart may still be the same
+	// event, seen after a step or before the board locks. The
+	// unwrapped times start from the host clock, so boards are
+	// usually within a window of each other from the start.
+
+	static int64_t const ALIGN_ACQUIRE = 64;
+
+	// A board steps to a new offset after this many outliers
+	// that agree with each other to within a window, provided
+	// nothing has matched for a whole acquisition range.
+
+	static uint32_t const ALIGN_STEP = 4;
+
+	// Marks an event a board hasn't seen; never a real time.
+
+	static int64_t const NO_OCCURRENCE = -(int64_t(1) << 62);
+
+	static int64_t magnitude(int64_t const v)
+	{
+	    return v < 0 ? -v : v;
+	}
+
+	static int64_t hostMicroseconds(Clock::Ticks const t)
+	{
+	    Clock::Ticks const freq = Clock::frequency();
+
+	    return int64_t(t / freq * 1000000u + t % freq * 1000000u / freq);
+	}
+
+	TimestampAligner::TimestampAligner(size_t const boards,
+					   uint32_t const w) :
+	    board(boards), window(w)
+	{
+	    if (boards == 0 || boards > MAX_BOARDS)
+		throw std::logic_error("illegal number of boards");
+
+	    for (size_t ii = 0; ii < boards; ++ii) {
+		Board& b = board[ii];
+
+		b.base = b.lastLocal = 0;
+		b.lastStamp = 0;
+		b.lastHost = 0;
+		b.started = false;
+		std::fill(b.recent, b.recent + 256, NO_OCCURRENCE);
+		std::fill(b.used, b.used + 256, NO_OCCURRENCE);
+		b.offset = b.drift = b.anchor = b.lastMatch = 0;
+		b.residual = 0;
+		b.stepError = 0;
+		b.matches = b.steps = b.outliers = 0;
+		b.locked = false;
+	    }
+	}
+
+	// The first event places the board's time on the host clock
+	// (and starts the wait for a first match there). A stamp
+	// lower than the last one means a reset. The time since the
+	// last event is taken from the host clock; if the events
+	// aren't timed, the gap is assumed to be zero and the loop
+	// absorbs the error.
+
+	int64_t TimestampAligner::unwrap(Board& b, Event const& ev)
+	{
+	    uint32_t const stamp = ev.entry.stamp();
+	    Clock::Ticks const host = ev.arrived ? ev.arrived : ev.drained;
+
+	    if (!b.started) {
+		b.base = host ? hostMicroseconds(host) - stamp : -int64_t(stamp);
+		b.anchor = b.lastMatch = b.base + stamp;
+		b.started = true;
+	    } else if (stamp < b.lastStamp) {
+		int64_t const gap = host && b.lastHost && host > b.lastHost ?
+		    Clock::toMicroseconds(host - b.lastHost) : 0;
+
+		b.base = b.lastLocal + gap - stamp;
+	    }
+
+	    b.lastStamp = stamp;
+	    b.lastHost = host;
+	    return b.lastLocal = b.base + stamp;
+	}
+
+	// Returns the reference time, in 1/256 us, of local time
+	// `local` (in us).
+
+	int64_t TimestampAligner::predict(Board const& b,
+					  int64_t const local) const
+	{
+	    int64_t const dt = (local - b.anchor) * 256;
+
+	    return (local * 256) + b.offset + ((dt * b.drift) >> 32);
+	}
+
+	// Decides whether an occurrence at `local` on board `b` and
+	// one at `ref` on the reference are the same event. Only
+	// pairs inside one window are; the rest of the acquisition
+	// range counts as outliers. Occurrences are paired at most
+	// once, so batched input can't match an event against an
+	// earlier repetition of it. Events that repeat within the
+	// acquisition range are ambiguous, which is why it isn't used
+	// for matching even before the board locks.
+
+	TimestampAligner::Pairing
+	TimestampAligner::classify(Board const& b, uint8_t const e,
+				   int64_t const local, int64_t const ref) const
+	{
+	    if (local == NO_OCCURRENCE || ref == NO_OCCURRENCE ||
+		ref == b.used[e])
+		return Unrelated;
+
+	    int64_t const err = magnitude(predict(b, local) - ref * 256);
+
+	    if (err <= window * 256)
+		return Same;
+	    return err <= window * ALIGN_ACQUIRE * 256 ? Outlier : Unrelated;
+	}
+
+	void TimestampAligner::match(Board& b, int64_t const local,
+				     int64_t const ref)
+	{
+	    int64_t const err = (ref * 256) - predict(b, local);
+
+	    ++b.matches;
+	    b.residual = int32_t(((err * 1000) >> 8));
+
+	    // Fold the drift into the offset so later predictions
+	    // only multiply small intervals.
+
+	    b.offset += ((((local - b.anchor) * 256) * b.drift) >> 32);
+	    b.anchor = local;
+
+	    if (!b.locked) {
+		b.offset += err;
+		b.locked = true;
+	    } else {
+		int64_t const dt = local - b.lastMatch;
+
+		b.offset += err >> ALIGN_ALPHA;
+		if (dt > 0)
+		    b.drift += ((err * (1 << 24)) / dt) >> ALIGN_BETA;
+	    }
+	    b.outliers = 0;
+	    b.lastMatch = local;
+	}
+
+	// A lone outlier is probably a false pairing (with another
+	// repetition, when the streams arrive in batches). A run of
+	// them with the same error, while nothing else matches, means
+	// the board really stepped (a reset seen at a different time,
+	// say) or hasn't locked yet, so the offset jumps and the loop
+	// carries on from there. Outliers aren't consumed: the
+	// occurrences may still pair with others.
+
+	void TimestampAligner::outlier(Board& b, int64_t const local,
+				       int64_t const ref)
+	{
+	    int64_t const err = (ref * 256) - predict(b, local);
+
+	    if (b.outliers != 0 && magnitude(err - b.stepError) > window * 256)
+		b.outliers = 0;
+	    b.stepError = err;
+	    if (++b.outliers < ALIGN_STEP ||
+		local - b.lastMatch <= window * ALIGN_ACQUIRE)
+		return;
+
+	    b.offset += ((((local - b.anchor) * 256) * b.drift) >> 32) + err;
+	    b.anchor = b.lastMatch = local;
+	    b.outliers = 0;
+	    if (b.locked)
+		++b.steps;
+	    b.locked = true;
+	}
+
+	// Pairs board `b`'s occurrence of event `e` at `local` with
+	// the reference's at `ref`. Matched occurrences are consumed
+	// on both sides: the board forgets its own and remembers the
+	// reference's as used.
+
+	void TimestampAligner::pair(Board& b, uint8_t const e,
+				    int64_t const local, int64_t const ref)
+	{
+	    switch (classify(b, e, local, ref)) {
+	     case Same:
+		match(b, local, ref);
+		b.recent[e] = NO_OCCURRENCE;
+		b.used[e] = ref;
+		break;
+
+	     case Outlier:
+		outlier(b, local, ref);
+		break;
+
+	     case Unrelated:
+		break;
+	    }
+	}
+
+	int64_t TimestampAligner::align(size_t const idx, Event const& ev)
+	{
+	    IPUCD_NO_HEAP;
+
+	    Board& b = board.at(idx);
+	    uint8_t const e = ev.entry.event();
+	    int64_t const local = unwrap(b, ev);
+
+	    b.recent[e] = local;
+
+	    if (idx == 0) {
+		for (size_t ii = 1; ii < board.size(); ++ii) {
+		    Board& o = board[ii];
+
+		    pair(o, e, o.recent[e], local);
+		}
+		return local;
+	    }
+
+	    pair(b, e, local, board[0].recent[e]);
+	    return predict(b, local) >> 8;
+	}
+
+	TimestampAligner::Estimate TimestampAligner::estimate(size_t const idx)
+	    const
+	{
+	    Board const& b = board.at(idx);
+	    Estimate e;
+
+	    e.offset = (b.offset * 1000) >> 8;
+	    e.drift = int32_t((b.drift * 1000000000) >> 32);
+	    e.residual = b.residual;
+	    e.matches = b.matches;
+	    e.steps = b.steps;
+	    e.locked = idx == 0 || b.locked;
+	    return e;
+	}
+
+	void TimestampAligner::dump() const
+	{
+	    for (size_t ii = 1; ii < board.size(); ++ii) {
+		Estimate const e = estimate(ii);
+
+		printf("board %2u: offset %lld ns, drift %d ppb, "
+		       "residual %d ns, %u matches, %u steps%s\n",
+		       unsigned(ii), (long long) e.offset, e.drift,
+		       e.residual, e.matches, e.steps,
+		       e.locked ? "" : " (unlocked)");
+	    }
+	}
+
+	void LatencyStats::dump() const
+	{
+	    static char const* const names[STAGES] = {
+		"hardware -> ISR", "ISR -> drain", "hardware -> drain",
+		"drain -> subscriber", "hardware -> subscriber"
+	    };
+
+	    for (size_t ii = 0; ii < STAGES; ++ii)
+		stage[ii].dump(names[ii], "ns");
+	}
+
+#ifdef __vxworks
+	Signal::Signal() : id(semBCreate(SEM_Q_PRIORITY, SEM_EMPTY))
+	{
+	    if (!id)
+		throw std::runtime_error("couldn't create semaphore");
+	}
+
+	Signal::~Signal()
+	{
+	    semDelete(id);
+	}
+
+	void Signal::raise()
+	{
+	    semGive(id);
+	}
+
+	bool Signal::wait(uint32_t const timeout)
+	{
+	    int const ticks = (timeout * sysClkRateGet() + 999) / 1000;
+
+	    return semTake(id, ticks) == OK;
+	}
+#else
+	Signal::Signal() : raised(false)
+	{
+	    pthread_mutex_init(&mtx, 0);
+	    pthread_cond_init(&cond, 0);
+	}
+
+	Signal::~Signal()
+	{
+	    pthread_cond_destroy(&cond);
+	    pthread_mutex_destroy(&mtx);
+	}
+
+	void Signal::raise()
+	{
+	    pthread_mutex_lock(&mtx);
+	    raised = true;
+	    pthread_cond_signal(&cond);
+	    pthread_mutex_unlock(&mtx);
+	}
+
+	bool Signal::wait(uint32_t const timeout)
+	{
+	    timespec ts;
+
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    ts.tv_sec += timeout / 1000;
+	    ts.tv_nsec += (timeout % 1000) * 1000000;
+	    if (ts.tv_nsec >= 1000000000) {
+		ts.tv_nsec -= 1000000000;
+		++ts.tv_sec;
+	    }
+
+	    pthread_mutex_lock(&mtx);
+
+	    int rc = 0;
+
+	    while (!raised && rc != ETIMEDOUT)
+		rc = pthread_cond_timedwait(&cond, &mtx, &ts);
+
+	    bool const result = raised;
+
+	    raised = false;
+	    pthread_mutex_unlock(&mtx);
+	    return result;
+	}
+#endif
+
+	void LockProfile::dump() const
+	{
+	    static char const* const names[LOCK_SITES] = {
+		"unknown", "init", "readFifo", "drain",
+		"adjustTclkReception", "getTclkReception", "getStatus",
+		"FIFO threshold", "FIFO triggers", "interrupts", "calibrate",
+		"trigger schedule"
+	    };
+
+	    for (size_t ii = 0; ii < LOCK_SITES; ++ii)
+		if (holdTime[ii].count()) {
+		    printf("--- %s ---\n", names[ii]);
+		    waitTime[ii].dump("wait", "ns");
+		    holdTime[ii].dump("hold", "ns");
+		}
+	}
+
+	TraceLog::Ring TraceLog::ring[CPUS];
+	bool volatile TraceLog::frozen = false;
+	bool TraceLog::freezeOnFault = false;
+
+	static bool olderThan(TraceRecord const& a, TraceRecord const& b)
+	{
+	    return a.time < b.time;
+	}
+
+	size_t TraceLog::snapshot(TraceRecord* const buf, size_t const n)
+	{
+	    std::vector<TraceRecord> all;
+
+	    for (size_t cc = 0; cc < CPUS; ++cc) {
+		uint32_t const next = ring[cc].next;
+		uint32_t const valid = std::min(next, uint32_t(DEPTH));
+
+		for (uint32_t ii = next - valid; ii != next; ++ii)
+		    all.push_back(ring[cc].rec[ii & (DEPTH - 1)]);
+	    }
+	    std::sort(all.begin(), all.end(), olderThan);
+
+	    size_t const total = std::min(n, all.size());
+
+	    std::copy(all.end() - total, all.end(), buf);
+	    return total;
+	}
+
+	void TraceLog::dump(size_t const last)
+	{
+	    static char const* const names[TRACE_OPS] = {
+		"none", "reg-read", "reg-write", "drain-begin", "drain-end",
+		"isr-entry", "isr-exit", "config", "status", "FAULT"
+	    };
+
+	    std::vector<TraceRecord> buf(last ? last : size_t(DEPTH) * CPUS);
+	    size_t const total = snapshot(&buf[0], buf.size());
+
+	    printf("trace: %u records%s\n", unsigned(total),
+		   frozen ? " (frozen)" : "");
+	    for (size_t ii = 0; ii < total; ++ii) {
+		TraceRecord const& rec = buf[ii];
+		unsigned long const us = (unsigned long)
+		    ((rec.time - buf[0].time) * 1000000u / Clock::frequency());
+
+		printf("%10lu us  board %3u  %-11s %04x %08x\n", us,
+		       rec.board, rec.op < TRACE_OPS ? names[rec.op] : "?",
+		       rec.arg0, rec.arg1);
+	    }
+	}
+
+	bool TraceLog::save(char const* const file)
+	{
+	    std::vector<TraceRecord> buf(size_t(DEPTH) * CPUS);
+	    uint32_t const hdr[3] = {
+		1, Clock::frequency(), uint32_t(snapshot(&buf[0], buf.size()))
+	    };
+	    FILE* const fp = fopen(file, "wb");
+
+	    if (!fp)
+		return false;
+
+	    bool const ok = fwrite("IPUCDTRC", 8, 1, fp) == 1 &&
+		fwrite(hdr, sizeof(hdr), 1, fp) == 1 &&
+		fwrite(&buf[0], sizeof(TraceRecord), hdr[2], fp) == hdr[2];
+
+	    return fclose(fp) == 0 && ok;
+	}
+
+	uint32_t HeapCheck::count = 0;
+	HeapCheck::Hook HeapCheck::hook = 0;
+
+#ifdef IPUCD_HEAP_CHECK
+	__thread unsigned HeapCheck::depth = 0;
+
+	void HeapCheck::allocated(size_t const bytes)
+	{
+	    if (LIKELY(!depth))
+		return;
+
+	    fetchAndIncrement(count);
+
+	    if (hook) {
+		unsigned const saved = depth;
+
+		depth = 0;
+		try {
+		    hook(bytes);
+		} catch (...) {
+		    depth = saved;
+		    throw;
+		}
+		depth = saved;
+	    }
+	}
+#endif
+
+	std::vector<BusAccess> BusTrace::trace;
+	uint32_t BusTrace::next = 0;
+	uint32_t BusTrace::count = 0;
+	uint32_t BusTrace::mismatches = 0;
+	uint32_t BusTrace::overruns = 0;
+	BusTrace::Mode volatile BusTrace::mode = BusTrace::Off;
+
+	void BusTrace::startRecording(size_t const capacity)
+	{
+	    mode = Off;
+	    trace.assign(capacity, BusAccess());
+	    next = 0;
+	    count = 0;
+	    mismatches = 0;
+	    overruns = 0;
+	    mode = Record;
+	}
+
+	void BusTrace::startReplay()
+	{
+	    mode = Off;
+	    next = 0;
+	    mismatches = 0;
+	    overruns = 0;
+	    mode = Replay;
+	}
+
+	uint32_t BusTrace::replay(uint8_t const space, uint32_t const base,
+				  uint16_t const offset, uint8_t const flags)
+	{
+	    uint32_t const idx = fetchAndIncrement(next);
+
+	    if (UNLIKELY(idx >= count)) {
+		++overruns;
+		return ~uint32_t(0);
+	    }
+
+	    BusAccess const& a = trace[idx];
+
+	    if (UNLIKELY(a.space != space || a.base != base ||
+			 a.offset != offset || a.flags != flags))
+		++mismatches;
+	    return a.value;
+	}
+
+	bool BusTrace::save(char const* const file)
+	{
+	    uint32_t const hdr[2] = { 1, count };
+	    FILE* const fp = fopen(file, "wb");
+
+	    if (!fp)
+		return false;
+
+	    bool const ok = fwrite("IPUCDBUS", 8, 1, fp) == 1 &&
+		fwrite(hdr, sizeof(hdr), 1, fp) == 1 &&
+		(count == 0 ||
+		 fwrite(&trace[0], sizeof(BusAccess), count, fp) == count);
+
+	    return fclose(fp) == 0 && ok;
+	}
+
+	bool BusTrace::load(char const* const file)
+	{
+	    FILE* const fp = fopen(file, "rb");
+	    uint32_t hdr[2] = { 0, 0 };
+	    char magic[8];
+
+	    if (!fp)
+		return false;
+
+	    bool ok = fread(magic, 8, 1, fp) == 1 &&
+		!memcmp(magic, "IPUCDBUS", 8) &&
+		fread(hdr, sizeof(hdr), 1, fp) == 1 && hdr[0] == 1;
+
+	    if (ok) {
+		mode = Off;
+		trace.assign(hdr[1], BusAccess());
+		ok = hdr[1] == 0 ||
+		    fread(&trace[0], sizeof(BusAccess), hdr[1], fp) == hdr[1];
+		count = ok ? hdr[1] : 0;
+		next = 0;
+	    }
+	    fclose(fp);
+	    return ok;
+	}
+
+	void IsrStats::dump() const
+	{
+	    latency.dump("interrupt latency", "ns");
+	    duration.dump("ISR duration", "ns");
+	    batch.dump("entries per interrupt", "entries");
+	}
+
+	void Calibration::dump() const
+	{
+	    commandToIsr.dump("command -> ISR", "ns");
+	    isrToTask.dump("ISR -> task", "ns");
+	    commandToTask.dump("command -> task", "ns");
+	    printf("missed: %u\n", missed);
+	}
+
+	// Each entry applies from its revision up to the next
+	// entry's. Only the basic path is known to work on every
+	// revision so far.
+
+	static struct {
+	    uint8_t revision;
+	    Capabilities caps;
+	} const capabilityTable[] = {
+	    { 0x00, { false, false } }
+	};
+
+	Capabilities lookupCapabilities(Identity const& id)
+	{
+	    size_t const n = sizeof(capabilityTable) / sizeof(*capabilityTable);
+	    Capabilities caps = capabilityTable[0].caps;
+
+	    for (size_t ii = 0; ii < n; ++ii)
+		if (capabilityTable[ii].revision <= id.revision)
+		    caps = capabilityTable[ii].caps;
+	    return caps;
+	}
+
+	void HW::isr(HW* const hw)
+	{
+	    hw->service();
+	}
+
+	void HW::enableInterrupts(LockType const& lock, int const vector,
+				  size_t const depth)
+	{
+	    IPUCD_LOCK_SITE(lock, SiteInterrupts);
+
+	    if (interruptMode)
+		throw std::logic_error("interrupts already enabled");
+
+	    pending.resize(depth);
+
+#ifdef __vxworks
+	    if (intConnect(INUM_TO_IVEC(vector), (VOIDFUNCPTR) &HW::isr,
+			   reinterpret_cast<int>(this)) != OK)
+		throw std::runtime_error("couldn't connect IP-UCD interrupt");
+#else
+	    (void) vector;
+#endif
+	    interruptMode = true;
+	}
+
+	void HW::enableTriggerDemux(LockType const& lock, size_t const depth)
+	{
+	    IPUCD_LOCK_SITE(lock, SiteDrain);
+
+	    if (demux[0])
+		throw std::logic_error("trigger demultiplexing already enabled");
+
+	    for (size_t ii = 0; ii < 8; ++ii)
+		try {
+		    demux[ii] = new BroadcastRing(depth);
+		}
+		catch (...) {
+		    while (ii-- > 0) {
+			delete demux[ii];
+			demux[ii] = 0;
+		    }
+		    throw;
+		}
+	}
+
+	HW::~HW()
+	{
+	    for (size_t ii = 0; ii < 8; ++ii)
+		delete demux[ii];
+	}
+
+	void* HW::operator new(size_t const size)
+	{
+#ifdef __vxworks
+	    void* const ptr = memalign(IPUCD_CACHE_LINE, size);
+#else
+	    void* ptr;
+
+	    if (posix_memalign(&ptr, IPUCD_CACHE_LINE, size))
+		ptr = 0;
+#endif
+	    if (!ptr)
+		throw std::bad_alloc();
+	    return ptr;
+	}
+
+	void HW::operator delete(void* const ptr)
+	{
+	    free(ptr);
+	}
+
+	HW::Layout HW::layout() const
+	{
+	    char const* const self = reinterpret_cast<char const*>(this);
+	    Layout l;
+
+	    l.drain = reinterpret_cast<char const*>(&a16) - self;
+	    l.interrupt = reinterpret_cast<char const*>(&isrA16) - self;
+	    l.config = reinterpret_cast<char const*>(&identity) - self;
+	    l.size = sizeof(*this);
+	    l.tuner = reinterpret_cast<char const*>(&tuner) - self;
+	    l.triggers = reinterpret_cast<char const*>(triggers) - self;
+	    l.pendingHead =
+		static_cast<char const*>(pending.headAddress()) - self;
+	    l.pendingTail =
+		static_cast<char const*>(pending.tailAddress()) - self;
+	    return l;
+	}
+
+	void HW::loadTriggerSchedule(LockType const& lock,
+				     TriggerSchedule const& sched,
+				     size_t const batch)
+	{
+	    IPUCD_LOCK_SITE(lock, SiteSchedule);
+
+	    if (batch == 0)
+		throw std::logic_error("schedule batch must be non-zero");
+
+	    TriggerSchedule next(sched);
+	    std::vector<TriggerSchedule::Write> start;
+
+	    next.compile(triggers, start);
+	    setupInterrupt(lock);
+
+	    for (size_t ii = 0; ii < start.size(); ++ii)
+		writeTrigger(lock, start[ii].event, start[ii].value);
+
+	    schedule = next;
+	    scheduleBatch = batch;
+	}
+
+	size_t HW::runTriggerSchedule(LockType const& lock)
+	{
+	    IPUCD_LOCK_SITE(lock, SiteSchedule);
+	    IPUCD_NO_HEAP;
+
+	    if (schedule.empty())
+		return 0;
+
+	    uint32_t const stamp = timing && clock.isValid() ?
+		clock.toStamp(Clock::now()) : getFtpTimestamp(lock);
+	    TriggerSchedule::Write w;
+	    size_t total = 0;
+
+	    while (total < scheduleBatch && schedule.next(stamp, w)) {
+		writeTrigger(lock, w.event, w.value);
+		++total;
+	    }
+	    return total;
+	}
+
+	void HW::enableBlockDrain(LockType const& lock, BlockRead const fn,
+				  void* const ctx)
+	{
+	    IPUCD_LOCK_SITE(lock, SiteDrain);
+
+#ifdef __vxworks
+	    if (!fn)
+		throw std::logic_error("no block transfer routine given");
+	    blockRead = fn;
+	    blockCtx = ctx;
+#else
+	    blockRead = fn ? fn : emulateBlockRead;
+	    blockCtx = fn ? ctx : this;
+#endif
+	    blockBuf.resize(0x100);
+	    selectDrainPath();
+	}
+
+#ifndef __vxworks
+	int HW::emulateBlockRead(void* const ctx, uint32_t, uint32_t* const dst,
+				 size_t const count)
+	{
+	    HW const* const hw = static_cast<HW const*>(ctx);
+	    IntLock const lock;
+
+	    for (size_t ii = 0; ii < count; ++ii)
+		dst[ii] = hw->isrA32.get<regFifo>(lock).raw();
+	    return int(count);
+	}
+#endif
+
+	// The threshold status bit is set while the FIFO holds at
+	// least the threshold, which is read again for each block
+	// since the tuner may change it. A failed transfer is counted
+	// and ends the block phase; whatever it may have consumed is
+	// lost, as it would be to an overflow. So does a word that
+	// reads as an empty FIFO (if the status bit lags the
+	// contents, say): it and the rest of the block are counted
+	// as empty, like the single-cycle loop stops at one.
+
+	size_t HW::blockDrain(LockType const& lock, Event* const buf,
+			      size_t const n)
+	{
+	    size_t total = 0;
+
+	    for (;;) {
+		size_t const block = currentThreshold();
+
+		if (block < 2 || n - total < block ||
+		    !(a16.get<regStatus>(lock) & FIFOThreshold))
+		    break;
+
+		int const got = blockRead(blockCtx, fifoAddr, &blockBuf[0],
+					  block);
+
+		if (got < 0 || size_t(got) > block) {
+		    ++blockStats.failures;
+		    break;
+		}
+
+		++blockStats.transfers;
+		trace(TraceRegRead, regFifo::RegOffset, got);
+
+		int ii = 0;
+
+		for (; ii < got; ++ii) {
+		    FifoEntry const entry(blockBuf[ii]);
+
+		    if (UNLIKELY(!entry.isValid()))
+			break;
+
+		    Event& ev = buf[total++];
+
+		    ev.entry = entry;
+		    ev.isr = 0;
+		    ev.drained = timing ? Clock::now() : 0;
+		    ev.arrived = 0;
+		    tune(a16, lock, ev.entry);
+		}
+
+		blockStats.entries += ii;
+		blockStats.empty += got - ii;
+		if (ii < got || size_t(got) < block)
+		    break;
+	    }
+	    return total;
+	}
+
+	// Runs the loopback measurement. A stale `probe` signal
+	// (from an event interrupt between iterations) is cleared
+	// before each injection, and a handler run that started
+	// before the command was written is counted as missed.
+
+	Calibration HW::calibrate(size_t const count,
+				  uint32_t const timeout)
+	{
+	    Calibration cal;
+
+	    {
+		LockType const lock(this);
+
+		IPUCD_LOCK_SITE(lock, SiteInterrupts);
+		if (!interruptMode)
+		    throw std::logic_error("calibration needs interrupts enabled");
+	    }
+
+	    probing = true;
+	    for (size_t ii = 0; ii < count; ++ii) {
+		probe.wait(0);
+
+		Clock::Ticks start;
+
+		{
+		    LockType const lock(this);
+
+		    start = Clock::now();
+		    generateInterrupt(lock);
+		}
+
+#ifndef __vxworks
+		service();
+#endif
+
+		if (!probe.wait(timeout)) {
+		    ++cal.missed;
+		    continue;
+		}
+
+		Clock::Ticks const woke = Clock::now();
+		Clock::Ticks handled;
+
+		{
+		    LockType const lock(this);
+
+		    handled = lastIsr;
+		}
+
+		if (handled < start || handled > woke) {
+		    ++cal.missed;
+		    continue;
+		}
+
+		cal.commandToIsr.record(Clock::toNanoseconds(handled - start));
+		cal.isrToTask.record(Clock::toNanoseconds(woke - handled));
+		cal.commandToTask.record(Clock::toNanoseconds(woke - start));
+	    }
+	    probing = false;
+	    return cal;
+	}
+
+	ChromeTrace::ChromeTrace(char const* const file) :
+	    fp(fopen(file, "w")), first(true), origin(0)
+	{
+	    if (!fp)
+		throw std::runtime_error("couldn't create trace file");
+	    for (size_t ii = 0; ii < 8; ++ii)
+		named[ii] = 0;
+	    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", fp);
+	}
+
+	ChromeTrace::~ChromeTrace()
+	{
+	    fputs("\n]}\n", fp);
+	    fclose(fp);
+	}
+
+	double ChromeTrace::toUs(Clock::Ticks const t, uint32_t const freq)
+	{
+	    if (origin == 0)
+		origin = t;
+	    return (double(t) - double(origin)) * 1.0e6 / freq;
+	}
+
+	// Starts a trace event object, leaving it open for the
+	// caller to add fields and close. The first time a board is
+	// seen, its process and track names are emitted.
+
+	void ChromeTrace::begin(char const* const ph, unsigned const pid,
+				unsigned const tid, double const ts)
+	{
+	    name(pid, 0);
+	    fprintf(fp, "%s\n{\"ph\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f",
+		    first ? "" : ",", ph, pid, tid, ts);
+	    first = false;
+	}
+
+	void ChromeTrace::name(unsigned const pid, char const* const process)
+	{
+	    static char const* const tracks[] = {
+		0, "TCLK events", "supercycles", "drain", "interrupts"
+	    };
+	    uint32_t const bit = 1u << (pid % 32);
+
+	    if (named[(pid / 32) % 8] & bit)
+		return;
+	    named[(pid / 32) % 8] |= bit;
+
+	    fprintf(fp, "%s\n{\"ph\":\"M\",\"pid\":%u,\"name\":\"process_name\","
+		    "\"args\":{\"name\":\"%s %u\"}}", first ? "" : ",", pid,
+		    process ? process : "IP-UCD board", pid);
+	    first = false;
+	    for (unsigned tid = TrackEvents; tid <= TrackIsr; ++tid)
+		fprintf(fp, ",\n{\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+			"\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+			pid, tid, tracks[tid]);
+	}
+
+	void ChromeTrace::addTrace(TraceRecord const* const rec,
+				   size_t const n, uint32_t const freq)
+	{
+	    static char const* const names[TRACE_OPS] = {
+		"none", "register read", "register write", "drain", "drain",
+		"interrupt", "interrupt", "config", "status", "FAULT"
+	    };
+
+	    for (size_t ii = 0; ii < n; ++ii) {
+		TraceRecord const& r = rec[ii];
+		double const ts = toUs(r.time, freq);
+		char const* const name = r.op < TRACE_OPS ? names[r.op] : "?";
+
+		switch (r.op) {
+		 case TraceDrainBegin:
+		 case TraceIsrEntry:
+		    begin("B", r.board, r.op == TraceDrainBegin ?
+			  TrackDrain : TrackIsr, ts);
+		    fprintf(fp, ",\"name\":\"%s\"}", name);
+		    break;
+
+		 case TraceDrainEnd:
+		 case TraceIsrExit:
+		    begin("E", r.board, r.op == TraceDrainEnd ?
+			  TrackDrain : TrackIsr, ts);
+		    fprintf(fp, ",\"args\":{\"entries\":%u}}", r.arg1);
+		    break;
+
+		 default:
+		    begin("i", r.board, TrackDrain, ts);
+		    fprintf(fp, ",\"s\":\"%c\",\"name\":\"%s\",\"args\":"
+			    "{\"arg0\":\"0x%04x\",\"arg1\":\"0x%08x\"}}",
+			    r.op == TraceFault ? 'g' : 't', name, r.arg0,
+			    r.arg1);
+		    break;
+		}
+	    }
+	}
+
+	// Events without an `arrived` time fall back to the time
+	// they were drained. A decreasing hardware stamp marks the
+	// start of a new supercycle.
+
+	void ChromeTrace::supercycle(unsigned const pid, double const start,
+				     double const dur, unsigned const cycle)
+	{
+	    begin("X", pid, TrackSupercycles, start);
+	    fprintf(fp, ",\"dur\":%.3f,\"name\":\"supercycle %u\"}", dur, cycle);
+	}
+
+	// A supercycle slice is written when the next one starts;
+	// the last one runs to the final event.
+
+	void ChromeTrace::addEvents(uint8_t const board,
+				    Event const* const ev, size_t const n)
+	{
+	    uint32_t const freq = Clock::frequency();
+	    bool open = false;
+	    double start = 0.0;
+	    double end = 0.0;
+	    uint32_t last = 0;
+	    unsigned cycle = 0;
+
+	    for (size_t ii = 0; ii < n; ++ii) {
+		Clock::Ticks const t = ev[ii].arrived ? ev[ii].arrived :
+		    ev[ii].drained;
+
+		if (t == 0)
+		    continue;
+
+		double const ts = toUs(t, freq);
+		uint32_t const stamp = ev[ii].entry.stamp();
+
+		if (!open || stamp < last) {
+		    if (open)
+			supercycle(board, start, ts - start, cycle++);
+		    start = ts;
+		    open = true;
+		}
+		last = stamp;
+		end = ts;
+
+		begin("i", board, TrackEvents, ts);
+		fprintf(fp, ",\"s\":\"t\",\"name\":\"$%02X\",\"args\":"
+			"{\"stamp\":%u}}", ev[ii].entry.event(), stamp);
+	    }
+	    if (open)
+		supercycle(board, start, end - start, cycle);
+	}
+
+	void ChromeTrace::addCapture(uint8_t const board,
+				     FifoEntry const* const entry,
+				     size_t const n)
+	{
+	    double base = 0.0;
+	    uint32_t last = 0;
+	    unsigned cycle = 0;
+
+	    name(board, "IP-UCD capture");
+	    for (size_t ii = 0; ii < n; ++ii) {
+		uint32_t const stamp = entry[ii].stamp();
+
+		if (ii != 0 && stamp < last) {
+		    supercycle(board, base, last + 1, cycle++);
+		    base += last + 1;
+		}
+		last = stamp;
+
+		begin("i", board, TrackEvents, base + stamp);
+		fprintf(fp, ",\"s\":\"t\",\"name\":\"$%02X\",\"args\":"
+			"{\"stamp\":%u}}", entry[ii].event(), stamp);
+	    }
+	    if (n != 0)
+		supercycle(board, base, last + 1, cycle);
+	}
+
+	bool ChromeTrace::convert(char const* const out,
+				  char const* const traceFile,
+				  char const* const captureFile,
+				  uint8_t const board)
+	{
+	    std::vector<TraceRecord> rec;
+	    std::vector<FifoEntry> cap;
+	    uint32_t hdr[3] = { 0, 0, 0 };
+
+	    if (traceFile) {
+		FILE* const fp = fopen(traceFile, "rb");
+		char magic[8];
+
+		if (!fp)
+		    return false;
+
+		bool ok = fread(magic, 8, 1, fp) == 1 &&
+		    !memcmp(magic, "IPUCDTRC", 8) &&
+		    fread(hdr, sizeof(hdr), 1, fp) == 1 && hdr[0] == 1;
+
+		if (ok) {
+		    rec.resize(hdr[2]);
+		    ok = hdr[2] == 0 ||
+			fread(&rec[0], sizeof(TraceRecord), hdr[2], fp) == hdr[2];
+		}
+		fclose(fp);
+		if (!ok)
+		    return false;
+	    }
+
+	    if (captureFile) {
+		FILE* const fp = fopen(captureFile, "rb");
+		uint8_t word[4];
+
+		if (!fp)
+		    return false;
+		while (fread(word, 4, 1, fp) == 1)
+		    cap.push_back(FifoEntry(uint32_t(word[0]) << 24 |
+					    uint32_t(word[1]) << 16 |
+					    uint32_t(word[2]) << 8 | word[3]));
+		fclose(fp);
+	    }
+
+	    try {
+		ChromeTrace trace(out);
+
+		if (!rec.empty())
+		    trace.addTrace(&rec[0], rec.size(), hdr[1]);
+		if (!cap.empty())
+		    trace.addCapture(board, &cap[0], cap.size());
+	    }
+	    catch (std::exception const&) {
+		return false;
+	    }
+	    return true;
+	}
+
+	size_t BroadcastRing::bytes(size_t const capacity)
+	{
+	    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+		throw std::logic_error("ring capacity must be a power of two");
+	    return sizeof(Header) + capacity * sizeof(BroadcastSlot);
+	}
+
+	BroadcastRing::Header* BroadcastRing::allocate(size_t const capacity)
+	{
+	    return reinterpret_cast<Header*>(new uint64_t[(bytes(capacity) + 7) / 8]);
+	}
+
+	// Fills in the header. The magic number is written last so a
+	// reader never accepts a partly initialized ring.
+
+	void BroadcastRing::init(size_t const capacity)
+	{
+	    memset(hdr->magic, 0, sizeof(hdr->magic));
+	    hdr->version = VERSION;
+	    hdr->capacity = capacity;
+	    hdr->slotSize = sizeof(BroadcastSlot);
+	    hdr->head = 0;
+	    for (size_t ii = 0; ii < capacity; ++ii)
+		slot[ii].seq = slot[ii].check = ~uint32_t(ii);
+	    IPUCD_BARRIER();
+	    memcpy(hdr->magic, "IPUCDRNG", 8);
+	}
+
+	BroadcastRing::BroadcastRing(size_t const capacity) :
+	    hdr(allocate(capacity)),
+	    slot(reinterpret_cast<BroadcastSlot*>(hdr + 1)),
+	    mask(capacity - 1)
+	{
+	    init(capacity);
+	}
+
+#ifdef __vxworks
+	BroadcastRing::~BroadcastRing()
+	{
+	    delete [] reinterpret_cast<uint64_t*>(hdr);
+	}
+#else
+	BroadcastRing::Header* BroadcastRing::share(char const* const name,
+						    size_t const capacity)
+	{
+	    size_t const size = bytes(capacity);
+
+	    shm_unlink(name);
+
+	    int const fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	    if (fd < 0)
+		throw std::runtime_error("couldn't create shared memory ring");
+
+	    void* const ptr = ftruncate(fd, size) == 0 ?
+		mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+		MAP_FAILED;
+
+	    close(fd);
+	    if (ptr == MAP_FAILED) {
+		shm_unlink(name);
+		throw std::runtime_error("couldn't map shared memory ring");
+	    }
+	    return static_cast<Header*>(ptr);
+	}
+
+	BroadcastRing::BroadcastRing(char const* const name,
+				     size_t const capacity) :
+	    shm(name), hdr(share(name, capacity)),
+	    slot(reinterpret_cast<BroadcastSlot*>(hdr + 1)),
+	    mask(capacity - 1)
+	{
+	    init(capacity);
+	}
+
+	BroadcastRing::~BroadcastRing()
+	{
+	    if (shm.empty())
+		delete [] reinterpret_cast<uint64_t*>(hdr);
+	    else {
+		munmap(hdr, bytes(mask + 1));
+		shm_unlink(shm.c_str());
+	    }
+	}
+
+	// Maps the ring and checks its header. The mapping is made
+	// before the size is known, so the header is mapped first
+	// and the whole ring after it's been validated.
+
+	static void const* mapRing(char const* const name, size_t& size)
+	{
+	    int const fd = shm_open(name, O_RDONLY, 0);
+
+	    if (fd < 0)
+		throw std::runtime_error("couldn't open shared memory ring");
+
+	    BroadcastRing::Header hdr;
+	    bool const ok = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		!memcmp(hdr.magic, "IPUCDRNG", 8) &&
+		hdr.version == BroadcastRing::VERSION &&
+		hdr.slotSize == sizeof(BroadcastSlot) &&
+		hdr.capacity != 0 && (hdr.capacity & (hdr.capacity - 1)) == 0;
+	    void* const ptr = ok ?
+		mmap(0, size = sizeof(hdr) + hdr.capacity * sizeof(BroadcastSlot),
+		     PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+	    close(fd);
+	    if (!ok)
+		throw std::runtime_error("incompatible shared memory ring");
+	    if (ptr == MAP_FAILED)
+		throw std::runtime_error("couldn't map shared memory ring");
+	    return ptr;
+	}
+
+	BroadcastReader::BroadcastReader(char const* const name) :
+	    size(0),
+	    hdr(static_cast<BroadcastRing::Header const*>(
+		    mapRing(name, size))),
+	    cursor(hdr)
+	{
+	}
+
+	BroadcastReader::~BroadcastReader()
+	{
+	    munmap(const_cast<BroadcastRing::Header*>(hdr), size);
+	}
+#endif
+
+#ifndef __vxworks
+	EventServer::EventServer(char const* const p,
+				 BroadcastRing const& r, size_t const batch) :
+	    ring(r), path(p), listener(socket(AF_UNIX, SOCK_STREAM, 0)),
+	    maxBatch(std::max(size_t(1), std::min(batch, size_t(IOV_MAX - 1)))),
+	    iov(maxBatch + 1), fds(1)
+	{
+	    sockaddr_un addr;
+
+	    if (listener < 0)
+		throw std::runtime_error("couldn't create event server socket");
+	    if (path.size() >= sizeof(addr.sun_path)) {
+		close(listener);
+		throw std::logic_error("event server path too long");
+	    }
+
+	    memset(&addr, 0, sizeof(addr));
+	    addr.sun_family = AF_UNIX;
+	    strcpy(addr.sun_path, p);
+	    unlink(p);
+
+	    if (bind(listener, reinterpret_cast<sockaddr*>(&addr),
+		     sizeof(addr)) < 0 || listen(listener, 8) < 0 ||
+		fcntl(listener, F_SETFL, O_NONBLOCK) < 0) {
+		close(listener);
+		throw std::runtime_error("couldn't listen on event server path");
+	    }
+	}
+
+	EventServer::~EventServer()
+	{
+	    for (size_t ii = 0; ii < clients.size(); ++ii)
+		close(clients[ii].fd);
+	    close(listener);
+	    unlink(path.c_str());
+	}
+
+	// New clients start with the next published event and
+	// receive every event until they send a mask.
+
+	void EventServer::accept()
+	{
+	    int fd;
+
+	    while ((fd = ::accept(listener, 0, 0)) >= 0) {
+		Client c;
+
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		c.fd = fd;
+		c.next = ring.head();
+		c.lost = 0;
+		c.mask.fill();
+		c.maskBytes = 0;
+		clients.push_back(c);
+	    }
+
+	    // A backlog never holds more than one frame, so it's
+	    // allocated here rather than when `send()` needs it.
+	    // Copying a client doesn't keep the capacity, so each one
+	    // is checked as `clients` grows.
+
+	    for (size_t ii = 0; ii < clients.size(); ++ii)
+		clients[ii].backlog.reserve(FRAME_WORDS * sizeof(uint32_t) +
+					    maxBatch * sizeof(BroadcastSlot));
+	    if (fds.size() < clients.size() + 1)
+		fds.resize(clients.size() + 1);
+	}
+
+	// Reads mask updates. A mask only takes effect once all 32
+	// bytes have arrived. Returns `false` if the client closed
+	// its connection.
+
+	bool EventServer::receive(Client& c)
+	{
+	    for (;;) {
+		ssize_t const len =
+		    read(c.fd, reinterpret_cast<char*>(c.incoming.words()) +
+			 c.maskBytes, sizeof(EventSet) - c.maskBytes);
+
+		if (len == 0)
+		    return false;
+		if (len < 0)
+		    return errno == EAGAIN || errno == EINTR;
+		if ((c.maskBytes += len) == sizeof(EventSet)) {
+		    c.mask = c.incoming;
+		    c.maskBytes = 0;
+		}
+	    }
+	}
+
+	// Sends the events the client hasn't seen in frames of up
+	// to `maxBatch` slots. Whatever part of a frame the socket
+	// doesn't accept is copied to the client's backlog and sent
+	// before anything else. Returns `false` if the connection
+	// failed.
+
+	bool EventServer::send(Client& c)
+	{
+	    if (!c.backlog.empty()) {
+		ssize_t const len = ::send(c.fd, &c.backlog[0], c.backlog.size(),
+					   MSG_NOSIGNAL);
+
+		if (len < 0)
+		    return errno == EAGAIN || errno == EINTR;
+		c.backlog.erase(c.backlog.begin(), c.backlog.begin() + len);
+		if (!c.backlog.empty())
+		    return true;
+	    }
+
+	    uint32_t frame[FRAME_WORDS];
+
+	    while (c.next != ring.head()) {
+		uint32_t const head = ring.head();
+
+		if (head - c.next > ring.capacity()) {
+		    c.lost += head - ring.capacity() - c.next;
+		    c.next = head - ring.capacity();
+		}
+
+		size_t count = 0;
+
+		frame[1] = c.next;
+		for (; c.next != head && count < maxBatch; ++c.next) {
+		    BroadcastSlot const& s = ring.at(c.next);
+
+		    if (c.mask.test(uint8_t(s.raw))) {
+			iov[++count].iov_base = const_cast<BroadcastSlot*>(&s);
+			iov[count].iov_len = sizeof(BroadcastSlot);
+		    }
+		}
+
+		if (count == 0)
+		    continue;
+
+		frame[0] = sizeof(frame) - sizeof(frame[0]) +
+		    count * sizeof(BroadcastSlot);
+		frame[2] = c.next;
+		frame[3] = count;
+		frame[4] = c.lost;
+		iov[0].iov_base = frame;
+		iov[0].iov_len = sizeof(frame);
+
+		msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov[0];
+		msg.msg_iovlen = count + 1;
+
+		ssize_t const len = sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+		size_t const total = sizeof(frame[0]) + frame[0];
+
+		if (len < 0 && errno != EAGAIN && errno != EINTR)
+		    return false;
+
+		c.lost = 0;
+
+		// Save the unsent part of the frame. Slots are copied
+		// and checked again; the client may already have the
+		// front of one, so a slot the producer touched in the
+		// meantime gets a `check` outside the frame, which
+		// doesn't match any `seq` the client accepts.
+
+		size_t skip = len > 0 ? size_t(len) : 0;
+
+		if (skip < total) {
+		    for (size_t ii = 0; ii <= count; ++ii) {
+			if (skip >= iov[ii].iov_len) {
+			    skip -= iov[ii].iov_len;
+			    continue;
+			}
+
+			char const* base =
+			    static_cast<char const*>(iov[ii].iov_base);
+			BroadcastSlot copy;
+
+			if (ii != 0) {
+			    BroadcastSlot const& s =
+				*static_cast<BroadcastSlot const*>(iov[ii].iov_base);
+
+			    copy = s;
+			    __sync_synchronize();
+			    if (s.seq != copy.seq || copy.check != copy.seq ||
+				copy.seq - frame[1] >= frame[2] - frame[1])
+				copy.seq = copy.check = frame[1] - 1;
+			    base = reinterpret_cast<char const*>(&copy);
+			}
+			c.backlog.insert(c.backlog.end(), base + skip,
+					 base + iov[ii].iov_len);
+			skip = 0;
+		    }
+		    return true;
+		}
+	    }
+	    return true;
+	}
+
+	// Does all of `poll()` but accepting new clients, which is
+	// the only part that allocates. Returns `true` if a client
+	// is waiting to connect.
+
+	bool EventServer::serve(int const timeout)
+	{
+	    IPUCD_NO_HEAP;
+
+	    size_t const n = clients.size() + 1;
+
+	    fds[0].fd = listener;
+	    fds[0].events = POLLIN;
+	    for (size_t ii = 0; ii < clients.size(); ++ii) {
+		fds[ii + 1].fd = clients[ii].fd;
+		fds[ii + 1].events = POLLIN;
+	    }
+
+	    bool const ready = ::poll(&fds[0], n, timeout) > 0;
+
+	    for (size_t ii = clients.size(); ii-- > 0;) {
+		Client& c = clients[ii];
+		bool const readable = ready &&
+		    (fds[ii + 1].revents & (POLLIN | POLLHUP | POLLERR));
+
+		if ((readable && !receive(c)) || !send(c)) {
+		    close(c.fd);
+		    clients.erase(clients.begin() + ii);
+		}
+	    }
+	    return ready && (fds[0].revents & POLLIN);
+	}
+
+	// New clients start at the ring's head, so there's nothing to
+	// send them until the next call.
+
+	void EventServer::poll(int const timeout)
+	{
+	    if (serve(timeout))
+		accept();
+	}
+#endif
+
+	Executor::JobQueue::JobQueue(size_t const depth) :
+	    mask(0), head(0), tail(0), dropped(0)
+	{
+	    size_t size = 1;
+
+	    while (size < depth)
+		size <<= 1;
+	    job.resize(size);
+	    mask = size - 1;
+	}
+
+	// Pushes as many of the `n` jobs as fit, under one lock, and
+	// returns how many that was.
+
+	size_t Executor::JobQueue::push(Job const* const j, size_t const n)
+	{
+	    Mutex::Lock const lock(&mutex);
+	    size_t const room = mask + 1 - (tail - head);
+	    size_t const count = std::min(n, room);
+
+	    for (size_t ii = 0; ii < count; ++ii)
+		job[tail++ & mask] = j[ii];
+	    dropped += n - count;
+	    return count;
+	}
+
+	// The owner takes the oldest job; thieves take the newest,
+	// which keeps them away from the owner's end of the queue.
+
+	bool Executor::JobQueue::popFront(Job& j)
+	{
+	    Mutex::Lock const lock(&mutex);
+
+	    if (head == tail)
+		return false;
+	    j = job[head++ & mask];
+	    return true;
+	}
+
+	bool Executor::JobQueue::popBack(Job& j)
+	{
+	    Mutex::Lock const lock(&mutex);
+
+	    if (head == tail)
+		return false;
+	    j = job[--tail & mask];
+	    return true;
+	}
+
+	Executor::Worker::Worker(Executor* const o, size_t const i,
+				 int const c, size_t const depth) :
+	    owner(o), index(i), cpu(c), queue(depth), idle(false)
+	{
+	    stats.executed = stats.stolen = stats.bulk = stats.dropped = 0;
+	}
+
+	Executor::Executor(std::vector<int> const& cpus, size_t const depth,
+			   int const prio, size_t const batch) :
+	    subscriptions(0), priority(prio), running(false), bulk(depth),
+	    bulkBatch(batch ? batch : 1), inlined(0)
+	{
+	    if (cpus.empty())
+		throw std::logic_error("executor needs at least one worker");
+
+	    staged.reserve(bulkBatch);
+
+	    try {
+		for (size_t ii = 0; ii < cpus.size(); ++ii)
+		    worker.push_back(new Worker(this, ii, cpus[ii], depth));
+	    }
+	    catch (...) {
+		for (size_t ii = 0; ii < worker.size(); ++ii)
+		    delete worker[ii];
+		throw;
+	    }
+	}
+
+	Executor::~Executor()
+	{
+	    stop();
+	    for (size_t ii = 0; ii < worker.size(); ++ii)
+		delete worker[ii];
+	}
+
+	void Executor::subscribe(uint8_t const event, Handler const fn,
+				 void* const arg, Priority const cls)
+	{
+	    if (running)
+		throw std::logic_error("executor already started");
+	    if (cls >= PRIORITIES)
+		throw std::logic_error("illegal priority class");
+
+	    size_t const home = cls == Soft ?
+		subscriptions++ % worker.size() : 0;
+	    Subscription const s = { fn, arg, home };
+
+	    subs[cls][event].push_back(s);
+	}
+
+#ifdef __vxworks
+	int Executor::entry(Worker* const w)
+	{
+	    w->owner->run(*w);
+	    return 0;
+	}
+#else
+	void* Executor::entry(void* const arg)
+	{
+	    Worker* const w = static_cast<Worker*>(arg);
+
+	    w->owner->run(*w);
+	    return 0;
+	}
+#endif
+
+	// Workers are created suspended (on VxWorks) so they can be
+	// pinned before they first run.
+
+	void Executor::start()
+	{
+	    if (running)
+		return;
+	    running = true;
+
+	    for (size_t ii = 0; ii < worker.size(); ++ii) {
+		Worker& w = *worker[ii];
+#ifdef __vxworks
+		char name[16];
+
+		snprintf(name, sizeof(name), "tIpucdW%u", unsigned(ii));
+		w.tid = taskCreate(name, priority, VX_FP_TASK, 0x4000,
+				   (FUNCPTR) entry, (int) &w, 0, 0, 0, 0, 0,
+				   0, 0, 0, 0);
+		if (w.tid == ERROR) {
+		    halt(ii);
+		    throw std::runtime_error("couldn't create worker task");
+		}
+#ifdef _WRS_CONFIG_SMP
+		if (w.cpu >= 0) {
+		    cpuset_t set;
+
+		    CPUSET_ZERO(set);
+		    CPUSET_SET(set, w.cpu);
+		    taskCpuAffinitySet(w.tid, set);
+		}
+#endif
+		taskActivate(w.tid);
+#else
+		if (pthread_create(&w.thread, 0, entry, &w) != 0) {
+		    halt(ii);
+		    throw std::runtime_error("couldn't create worker thread");
+		}
+#ifdef __linux__
+		if (w.cpu >= 0) {
+		    cpu_set_t set;
+
+		    CPU_ZERO(&set);
+		    CPU_SET(w.cpu, &set);
+		    pthread_setaffinity_np(w.thread, sizeof(set), &set);
+		}
+#endif
+#endif
+	    }
+	}
+
+	// Stops the first `n` workers. Queued jobs which haven't
+	// started are abandoned.
+
+	void Executor::halt(size_t const n)
+	{
+	    running = false;
+
+	    for (size_t ii = 0; ii < n; ++ii)
+		worker[ii]->wake.raise();
+
+	    for (size_t ii = 0; ii < n; ++ii) {
+		while (!worker[ii]->done.wait(1000))
+		    ;
+#ifndef __vxworks
+		pthread_join(worker[ii]->thread, 0);
+#endif
+	    }
+	}
+
+	void Executor::stop()
+	{
+	    if (running)
+		halt(worker.size());
+	}
+
+	bool Executor::steal(size_t const self, Job& j)
+	{
+	    for (size_t ii = 1; ii < worker.size(); ++ii) {
+		Worker& victim = *worker[(self + ii) % worker.size()];
+
+		if (victim.queue.popBack(j)) {
+		    ++worker[self]->stats.stolen;
+		    return true;
+		}
+	    }
+	    return false;
+	}
+
+	// `wake` is a latching signal, so a dispatch between the
+	// last empty check and the wait isn't lost.
+
+	void Executor::run(Worker& w)
+	{
+	    while (running) {
+		IPUCD_NO_HEAP;
+
+		Job j;
+
+		if (w.queue.popFront(j) || steal(w.index, j)) {
+		    delivering(w.latency, j.ev);
+		    j.fn(j.ev, j.arg);
+		    ++w.stats.executed;
+		} else if (bulk.popFront(j)) {
+		    delivering(w.latency, j.ev);
+		    j.fn(j.ev, j.arg);
+		    ++w.stats.bulk;
+		} else {
+		    w.idle = true;
+		    w.wake.wait(100);
+		    w.idle = false;
+		}
+	    }
+	    w.done.raise();
+	}
+
+	// Wakes the first idle worker other than `busy`.
+
+	void Executor::wakeHelper(Worker const& busy)
+	{
+	    for (size_t ii = 0; ii < worker.size(); ++ii)
+		if (worker[ii] != &busy && worker[ii]->idle) {
+		    worker[ii]->wake.raise();
+		    break;
+		}
+	}
+
+	void Executor::hard(Event const& ev)
+	{
+	    std::vector<Subscription> const& list =
+		subs[HardRealTime][ev.entry.event()];
+
+	    for (size_t ii = 0; ii < list.size(); ++ii) {
+		delivering(inlineLatency, ev);
+		list[ii].fn(ev, list[ii].arg);
+	    }
+	    inlined += list.size();
+	}
+
+	void Executor::soft(Event const& ev)
+	{
+	    std::vector<Subscription> const& list =
+		subs[Soft][ev.entry.event()];
+
+	    for (size_t ii = 0; ii < list.size(); ++ii) {
+		Worker& home = *worker[list[ii].home];
+		Job const j = { list[ii].fn, list[ii].arg, ev };
+
+		if (!home.queue.push(&j, 1))
+		    continue;
+
+		home.wake.raise();
+		if (!home.idle)
+		    wakeHelper(home);
+	    }
+	}
+
+	void Executor::stage(Event const& ev)
+	{
+	    std::vector<Subscription> const& list =
+		subs[Bulk][ev.entry.event()];
+
+	    for (size_t ii = 0; ii < list.size(); ++ii) {
+		Job const j = { list[ii].fn, list[ii].arg, ev };
+
+		staged.push_back(j);
+		if (staged.size() >= bulkBatch)
+		    flush();
+	    }
+	}
+
+	void Executor::dispatch(Event const* const buf, size_t const n)
+	{
+	    IPUCD_NO_HEAP;
+
+	    for (size_t ii = 0; ii < n; ++ii)
+		hard(buf[ii]);
+	    for (size_t ii = 0; ii < n; ++ii)
+		soft(buf[ii]);
+	    for (size_t ii = 0; ii < n; ++ii)
+		stage(buf[ii]);
+	    flush();
+	}
+
+	// Bulk work only needs one worker's attention; the idle
+	// ones are woken in turn as batches arrive.
+
+	void Executor::flush()
+	{
+	    if (staged.empty())
+		return;
+
+	    bulk.push(&staged[0], staged.size());
+	    staged.clear();
+	    for (size_t ii = 0; ii < worker.size(); ++ii)
+		if (worker[ii]->idle) {
+		    worker[ii]->wake.raise();
+		    break;
+		}
+	}
+
+	LatencyStats Executor::latency() const
+	{
+	    LatencyStats total = inlineLatency;
+
+	    for (size_t ii = 0; ii < worker.size(); ++ii)
+		total.merge(worker[ii]->latency);
+	    return total;
+	}
+
+	void Executor::dump() const
+	{
+	    printf("inline: %u, bulk dropped: %u\n", inlined, bulk.dropped);
+	    for (size_t ii = 0; ii < worker.size(); ++ii) {
+		Worker const& w = *worker[ii];
+
+		printf("worker %u (cpu %d): executed %u, stolen %u, "
+		       "bulk %u, dropped %u\n", unsigned(ii), w.cpu,
+		       w.stats.executed, w.stats.stolen, w.stats.bulk,
+		       w.queue.dropped);
+	    }
+	}
+
+	void CoalescingSubscription::handler(Event const& ev, void* const arg)
+	{
+	    static_cast<CoalescingSubscription*>(arg)->update(ev);
+	}
+
+	void CoalescingSubscription::attach(Executor& exec)
+	{
+	    for (size_t ii = 0; ii < 256; ++ii)
+		if (subscribed.test(ii))
+		    exec.subscribe(ii, handler, this, Executor::HardRealTime);
+	}
+
+	void CoalescingSubscription::update(Event const& ev)
+	{
+	    IPUCD_NO_HEAP;
+
+	    uint8_t const e = ev.entry.event();
+
+	    if (!subscribed.test(e))
+		return;
+
+	    Mutex::Lock const lock(&mutex);
+
+	    if (dirty.test(e))
+		++coalesced;
+	    slot[e] = ev;
+	    dirty.set(e);
+	    ++updates;
+	}
+
+	size_t CoalescingSubscription::read(Event* const buf)
+	{
+	    IPUCD_NO_HEAP;
+
+	    Mutex::Lock const lock(&mutex);
+	    uint32_t* const word = dirty.words();
+	    size_t total = 0;
+
+	    for (size_t ii = 0; ii < EventSet::WORDS; ++ii) {
+		uint32_t bits = word[ii];
+
+		while (bits) {
+		    buf[total++] = slot[ii * 32 + __builtin_ctz(bits)];
+		    bits &= bits - 1;
+		}
+		word[ii] = 0;
+	    }
+	    return total;
+	}
+    }
+}
+
+#ifdef IPUCD_HEAP_CHECK
+
+// The replacement allocation functions. Every allocation in the
+// program is reported to `HeapCheck`, which ignores those made
+// outside its scopes. They're kept out of line so GCC doesn't pair
+// an inlined `free()` with `operator new` and warn.
+
+__attribute__((noinline))
+void* operator new(size_t const size) throw (std::bad_alloc)
+{
+    IPUCD::v1_0::HeapCheck::allocated(size);
+
+    void* const ptr = malloc(size ? size : 1);
+
+    if (!ptr)
+	throw std::bad_alloc();
+    return ptr;
+}
+
+__attribute__((noinline))
+void* operator new[](size_t const size) throw (std::bad_alloc)
+{
+    return operator new(size);
+}
+
+__attribute__((noinline))
+void* operator new(size_t const size, std::nothrow_t const&) throw ()
+{
+    try {
+	return operator new(size);
+    } catch (...) {
+	return 0;
+    }
+}
+
+__attribute__((noinline))
+void* operator new[](size_t const size, std::nothrow_t const&) throw ()
+{
+    return operator new(size, std::nothrow);
+}
+
+__attribute__((noinline))
+void operator delete(void* const ptr) throw ()
+{
+    free(ptr);
+}
+
+__attribute__((noinline))
+void operator delete[](void* const ptr) throw ()
+{
+    free(ptr);
+}
+
+__attribute__((noinline))
+void operator delete(void* const ptr, std::nothrow_t const&) throw ()
+{
+    free(ptr);
+}
+
+__attribute__((noinline))
+void operator delete[](void* const ptr, std::nothrow_t const&) throw ()
+{
+    free(ptr);
+}
+
+#endif
+
+// Local variables:
+// mode: c++
+// End:
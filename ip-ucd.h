@@ -1,5 +1,23 @@
+#include <algorithm>
+#include <cstdio>
 #include <stdexcept>
+#include <string>
+#include <vector>
 #include <vwpp-3.0.h>
+#ifdef __vxworks
+#include <vxLib.h>
+#include <semLib.h>
+#ifdef _WRS_CONFIG_SMP
+#include <vxCpuLib.h>
+#include <vxAtomicLib.h>
+#endif
+#include <drv/timer/timerDev.h>
+#else
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <time.h>
+#endif
 
 // Open the IPCUD namespace for forward definitions.
 
@@ -14,93 +32,1685 @@ namespace IPUCD {
 	class FifoEntry {
 	    static uint32_t const NO_VALUE = 0xffffffff;
 
-	    uint32_t const value;
+	    uint32_t value;
 
 	 public:
 	    explicit FifoEntry(uint32_t v = NO_VALUE) : value(v) {}
 
 	    uint8_t event() const { return uint8_t(value); }
 	    uint32_t stamp() const { return value >> 8; }
+	    uint32_t raw() const { return value; }
 	    bool isValid() const { return value != NO_VALUE; }
 	};
     }
 }
 
-// Have to re-open the vwpp::v3_0 namespace to insert a new
-// template. Some C++ template ugliness.
+namespace IPUCD {
+    namespace v1_0 {
+	using namespace vwpp::v3_0;
+
+	// A helper template to define "registers" that reside in the
+	// Industry Pack's PROM space (like module IDs.) To define a
+	// location, you only need to specify an offset.
+
+	template <size_t Offset>
+	struct PROM
+	    : public VME::Register<VME::A16, uint8_t, Offset, VME::Read, VME::NoWrite>
+	{};
+
+	// This is a common definition type for "config" registers;
+	// registers that change the behavior of the hardware. THey
+	// all are readable and writable but they all require a
+	// confirmed write.
+
+	template <typename T, size_t Offset>
+	struct ConfigReg
+	    : public VME::Register<VME::A16, T, Offset, VME::Read, VME::ConfirmWrite>
+	{};
+
+	// How `WideRegister` reads its two halves. `SingleCycle`
+	// reads both in one D32 cycle, so it needs the high word at
+	// the lower address (the bus is big-endian) and a D32 window;
+	// it can't tear.
+
+	enum WordOrder { HighWordFirst, LowWordFirst, SingleCycle };
+
+	// `Verified` re-reads one half to catch a carry between the
+	// two reads. It assumes a counting register whose high word
+	// changes at most once during the read, so it costs one extra
+	// cycle (two when a carry is caught). Destructive reads can't
+	// be verified.
+
+	enum ReadCheck { Unverified, Verified };
+
+	// Joins the two halves of a wide register into its value.
+
+	struct ConcatWords {
+	    static uint32_t compose(uint32_t const hi, uint32_t const lo)
+	    {
+		return (hi << 16) | lo;
+	    }
+	};
+
+	template <size_t High, size_t Low, VME::ReadAccess R, WordOrder O,
+		  ReadCheck C>
+	struct WideRead;
+
+	template <size_t High, size_t Low, VME::ReadAccess R>
+	struct WideRead<High, Low, R, HighWordFirst, Unverified> {
+	    typedef uint16_t AtomicType;
+
+	    static void read(uint8_t volatile* const base, uint32_t& hi,
+			     uint32_t& lo)
+	    {
+		hi = VME::ReadAPI<AtomicType, High, R>::readMem(base, 0);
+		lo = VME::ReadAPI<AtomicType, Low, R>::readMem(base, 0);
+	    }
+	};
+
+	template <size_t High, size_t Low, VME::ReadAccess R>
+	struct WideRead<High, Low, R, LowWordFirst, Unverified> {
+	    typedef uint16_t AtomicType;
+
+	    static void read(uint8_t volatile* const base, uint32_t& hi,
+			     uint32_t& lo)
+	    {
+		lo = VME::ReadAPI<AtomicType, Low, R>::readMem(base, 0);
+		hi = VME::ReadAPI<AtomicType, High, R>::readMem(base, 0);
+	    }
+	};
+
+	// If the high word moved, the low word may belong to either
+	// value; reading it again pairs it with the new one.
+
+	template <size_t High, size_t Low>
+	struct WideRead<High, Low, VME::Read, HighWordFirst, Verified> {
+	    typedef uint16_t AtomicType;
+	    typedef VME::ReadAPI<AtomicType, High, VME::Read> HighAPI;
+	    typedef VME::ReadAPI<AtomicType, Low, VME::Read> LowAPI;
+
+	    static void read(uint8_t volatile* const base, uint32_t& hi,
+			     uint32_t& lo)
+	    {
+		hi = HighAPI::readMem(base, 0);
+		lo = LowAPI::readMem(base, 0);
+
+		uint32_t const again = HighAPI::readMem(base, 0);
+
+		if (UNLIKELY(again != hi)) {
+		    hi = again;
+		    lo = LowAPI::readMem(base, 0);
+		}
+	    }
+	};
+
+	// If the low word went backwards, it carried somewhere
+	// between the reads and the high word may be stale; it's read
+	// again to pair with the second low word.
+
+	template <size_t High, size_t Low>
+	struct WideRead<High, Low, VME::Read, LowWordFirst, Verified> {
+	    typedef uint16_t AtomicType;
+	    typedef VME::ReadAPI<AtomicType, High, VME::Read> HighAPI;
+	    typedef VME::ReadAPI<AtomicType, Low, VME::Read> LowAPI;
+
+	    static void read(uint8_t volatile* const base, uint32_t& hi,
+			     uint32_t& lo)
+	    {
+		lo = LowAPI::readMem(base, 0);
+		hi = HighAPI::readMem(base, 0);
+
+		uint32_t const again = LowAPI::readMem(base, 0);
+
+		if (UNLIKELY(again < lo)) {
+		    lo = again;
+		    hi = HighAPI::readMem(base, 0);
+		}
+	    }
+	};
+
+	template <size_t High, size_t Low, VME::ReadAccess R>
+	struct WideRead<High, Low, R, SingleCycle, Unverified> {
+	    typedef uint32_t AtomicType;
+
+	    // Fails to compile unless the words are adjacent with the
+	    // high one first.
+
+	    typedef char Adjacent[Low == High + 2 ? 1 : -1];
+
+	    static void read(uint8_t volatile* const base, uint32_t& hi,
+			     uint32_t& lo)
+	    {
+		uint32_t const v = VME::ReadAPI<AtomicType, High, R>::readMem(base, 0);
+
+		hi = v >> 16;
+		lo = v & 0xffff;
+	    }
+	};
+
+	// A read-only "virtual register" of type `T` built from two
+	// 16-bit registers at offsets `High` and `Low` of the same
+	// window. It's read through the usual `A16`/`A32` memory
+	// objects, like any other register. `O` and `C` select the
+	// read order and tear check (see above) and `Compose` joins
+	// the halves; `T` is built from the joined value. Undefined
+	// combinations (a verified destructive read, say) don't
+	// compile.
+
+	template <VME::AddressSpace S, typename T, size_t High, size_t Low,
+		  VME::ReadAccess R = VME::Read, WordOrder O = HighWordFirst,
+		  ReadCheck C = Unverified, typename Compose = ConcatWords>
+	struct WideRegister {
+	    typedef WideRead<High, Low, R, O, C> Reader;
+
+	    typedef T Type;
+	    typedef typename Reader::AtomicType AtomicType;
+
+	    static VME::AddressSpace const space = S;
+
+	    enum { RegOffset = High < Low ? High : Low, RegEntries = 1 };
+
+	    static Type read(uint8_t volatile* const base)
+	    {
+		uint32_t hi, lo;
+
+		Reader::read(base, hi, lo);
+		return Type(Compose::compose(hi, lo));
+	    }
+	};
+
+	// Define control register commands.
+
+	enum ControlCommand {
+	    NoOp = 0x0,
+	    EnableTCLK = 0x1,
+	    DisableTCLK = 0x2,
+	    EnableMDAT = 0x3,
+	    DisableMDAT = 0x4,
+	    MDAT_Buf0 = 0x5,
+	    MDAT_Buf1 = 0x6,
+	    EnableMDAT_BufAuto = 0x7,
+	    DisableMDAT_BufAuto = 0x8,
+	    SW_Interrupt = 0x9,
+	    SW_Reset = 0xff
+	};
+
+	// Computes a FIFO threshold from the observed event rate. The
+	// threshold interrupt fires once `threshold` entries are
+	// queued, so the first entry of a batch waits for
+	// `threshold - 1` more arrivals before it's delivered. The
+	// tuner picks the largest threshold (fewest interrupts) that
+	// keeps that wait under the caller's latency budget.
+	//
+	// The arrival rate is measured from the hardware stamps of
+	// the entries themselves, so no host clock is needed. Samples
+	// that span a timestamp reset are discarded. The mean
+	// inter-arrival time is kept as an exponentially weighted
+	// average in 1/16 microsecond units to avoid floating point
+	// in the drain path.
+
+	class ThresholdTuner {
+	    enum { FRAC_BITS = 4, WEIGHT_BITS = 3, EVAL_PERIOD = 8 };
+
+	    uint32_t maxLatency;
+	    uint8_t maxThreshold;
+	    uint8_t current;
+	    uint8_t target;
+	    bool primed;
+	    uint32_t lastStamp;
+	    uint32_t interval;
+	    uint32_t samples;
+	    uint32_t adjustments;
+	    uint32_t raises;
+	    uint32_t lowers;
+
+	 public:
+
+	    // A snapshot of the tuner's state and its most recent
+	    // decision. `rate` is in events per second, `interval`
+	    // and `latency` are in microseconds and `interruptRate`
+	    // is the expected number of threshold interrupts per
+	    // second at the current threshold.
+
+	    struct Metrics {
+		uint32_t rate;
+		uint32_t interval;
+		uint32_t latency;
+		uint32_t interruptRate;
+		uint32_t samples;
+		uint32_t adjustments;
+		uint32_t raises;
+		uint32_t lowers;
+		uint8_t threshold;
+		uint8_t target;
+	    };
+
+	    explicit ThresholdTuner(uint32_t const budget = 0,
+				    uint8_t const limit = 0xff) :
+		maxLatency(budget), maxThreshold(limit ? limit : 1),
+		current(1), target(1), primed(false), lastStamp(0),
+		interval(0), samples(0), adjustments(0), raises(0),
+		lowers(0)
+	    {}
+
+	    bool isEnabled() const { return maxLatency != 0; }
+	    uint8_t threshold() const { return current; }
+
+	    // Feeds one FIFO entry into the rate estimate. Returns
+	    // `true` if the threshold should be reprogrammed; the new
+	    // value is available from `threshold()`.
+
+	    bool observe(FifoEntry const& entry)
+	    {
+		uint32_t const stamp = entry.stamp();
+
+		if (primed && stamp >= lastStamp) {
+		    int32_t const delta =
+			int32_t((stamp - lastStamp) << FRAC_BITS) -
+			int32_t(interval);
+
+		    interval = samples++ ? interval + (delta >> WEIGHT_BITS)
+			: (stamp - lastStamp) << FRAC_BITS;
+		    lastStamp = stamp;
+		    return samples % EVAL_PERIOD == 0 && evaluate();
+		}
+		lastStamp = stamp;
+		primed = true;
+		return false;
+	    }
+
+	    // Computes the target threshold from the current
+	    // estimate. Lowering the threshold is done immediately
+	    // since a rate drop means the latency budget is already
+	    // being exceeded. Raising it only happens once the target
+	    // is 25% above the current value so a noisy estimate
+	    // doesn't cause a register write for every batch.
+
+	    bool evaluate()
+	    {
+		uint32_t const avg = interval ? interval : 1;
+		uint32_t const n = ((maxLatency << FRAC_BITS) / avg) + 1;
+
+		target = uint8_t(n > maxThreshold ? maxThreshold : n);
+		if (target < current) {
+		    ++lowers;
+		} else if (target > current + current / 4) {
+		    ++raises;
+		} else
+		    return false;
+		current = target;
+		++adjustments;
+		return true;
+	    }
+
+	    Metrics metrics() const
+	    {
+		Metrics m;
+		uint32_t const avg = interval ? interval : 1;
+
+		m.interval = interval >> FRAC_BITS;
+		m.rate = samples ? (1000000u << FRAC_BITS) / avg : 0;
+		m.latency = ((current - 1) * avg) >> FRAC_BITS;
+		m.interruptRate = m.rate / current;
+		m.samples = samples;
+		m.adjustments = adjustments;
+		m.raises = raises;
+		m.lowers = lowers;
+		m.threshold = current;
+		m.target = target;
+		return m;
+	    }
+	};
+
+	// Provides access to the host's high-resolution clock. On the
+	// PowerPC targets this is the 64-bit time base. The BSPs run
+	// the system timestamp driver from the same counter, so
+	// `sysTimestampFreq()` reports its rate. Hosted builds use
+	// the POSIX monotonic clock.
+
+	struct Clock {
+	    typedef uint64_t Ticks;
+
+	    static Ticks now()
+	    {
+#ifdef __vxworks
+		UINT32 hi, lo;
+
+		vxTimeBaseGet(&hi, &lo);
+		return (Ticks(hi) << 32) | lo;
+#else
+		timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return Ticks(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+#endif
+	    }
+
+	    static uint32_t frequency()
+	    {
+#ifdef __vxworks
+		return sysTimestampFreq();
+#else
+		return 1000000000u;
+#endif
+	    }
+
+	    // Converts a tick interval to nanoseconds. Intervals that
+	    // don't fit in 32 bits (about four seconds) are clamped.
+
+	    static uint32_t toNanoseconds(Ticks const delta)
+	    {
+		Ticks const freq = frequency();
+
+		if (delta >= (freq << 2))
+		    return 0xffffffff;
+		return uint32_t(delta * 1000000000u / freq);
+	    }
+
+	    static Ticks fromMicroseconds(uint32_t const us)
+	    {
+		return Ticks(us) * frequency() / 1000000u;
+	    }
+
+	    static uint32_t toMicroseconds(Ticks const delta)
+	    {
+		Ticks const us = delta * 1000000u / frequency();
+
+		return us > 0xffffffffu ? 0xffffffff : uint32_t(us);
+	    }
+	};
+
+	// A histogram with power-of-two buckets. Bucket 0 counts
+	// zeroes and bucket `n` counts values in [2^(n-1), 2^n). It
+	// uses no locks and no dynamic memory so it can be updated
+	// from the drain path; it assumes a single writer.
+
+	class Histogram {
+	 public:
+	    enum { BUCKETS = 33 };
+
+	 private:
+	    uint32_t bucket[BUCKETS];
+	    uint32_t total;
+	    uint32_t low;
+	    uint32_t high;
+	    uint64_t sum;
+
+	 public:
+	    Histogram() { reset(); }
+
+	    void reset()
+	    {
+		for (size_t ii = 0; ii < BUCKETS; ++ii)
+		    bucket[ii] = 0;
+		total = 0;
+		low = 0xffffffff;
+		high = 0;
+		sum = 0;
+	    }
+
+	    void record(uint32_t const value)
+	    {
+		++bucket[value ? 32 - __builtin_clz(value) : 0];
+		++total;
+		sum += value;
+		if (value < low)
+		    low = value;
+		if (value > high)
+		    high = value;
+	    }
+
+	    // Adds the samples of `o`, so histograms kept by separate
+	    // writers can be reported together.
+
+	    void merge(Histogram const& o)
+	    {
+		for (size_t ii = 0; ii < BUCKETS; ++ii)
+		    bucket[ii] += o.bucket[ii];
+		total += o.total;
+		sum += o.sum;
+		if (o.low < low)
+		    low = o.low;
+		if (o.high > high)
+		    high = o.high;
+	    }
+
+	    uint32_t count() const { return total; }
+	    uint32_t count(size_t const idx) const { return bucket[idx]; }
+	    uint32_t min() const { return total ? low : 0; }
+	    uint32_t max() const { return high; }
+	    uint32_t mean() const { return total ? uint32_t(sum / total) : 0; }
+
+	    // Returns the upper bound of the bucket holding the
+	    // `pct` percentile.
+
+	    uint32_t percentile(unsigned const pct) const;
+
+	    void dump(char const* label, char const* units) const;
+	};
+
+	// Holds a FIFO entry along with optional host timestamps of
+	// its trip through the driver. `arrived` is the hardware
+	// stamp translated to host time through the clock model,
+	// `isr` is when an interrupt handler pulled it from the FIFO
+	// and `drained` is when the reading task received it. A
+	// timestamp of zero means that stage wasn't recorded.
+
+	struct Event {
+	    FifoEntry entry;
+	    Clock::Ticks arrived;
+	    Clock::Ticks isr;
+	    Clock::Ticks drained;
+
+	    Event() : arrived(0), isr(0), drained(0) {}
+	};
+
+	// A set of TCLK events, stored as a 256-bit bitmap.
+
+	class EventSet {
+	    uint32_t word[8];
+
+	 public:
+	    enum { WORDS = 8 };
+
+	    EventSet() { clear(); }
+
+	    void clear()
+	    {
+		for (size_t ii = 0; ii < WORDS; ++ii)
+		    word[ii] = 0;
+	    }
+
+	    void fill()
+	    {
+		for (size_t ii = 0; ii < WORDS; ++ii)
+		    word[ii] = 0xffffffff;
+	    }
+
+	    void set(uint8_t const ev) { word[ev >> 5] |= 1u << (ev & 31); }
+	    void reset(uint8_t const ev) { word[ev >> 5] &= ~(1u << (ev & 31)); }
+	    bool test(uint8_t const ev) const
+	    {
+		return (word[ev >> 5] >> (ev & 31)) & 1;
+	    }
+
+	    uint32_t* words() { return word; }
+	    uint32_t const* words() const { return word; }
+	};
+
+	// Orders memory accesses for structures shared without a lock
+	// (the broadcast ring).
+
+#if defined(__vxworks) && defined(__PPC__)
+#define IPUCD_BARRIER() __asm__ __volatile__ ("sync" ::: "memory")
+#else
+#define IPUCD_BARRIER() __sync_synchronize()
+#endif
+
+	// Relates the 24-bit hardware stamps to host time. An anchor
+	// pairs a reading of the FTP timestamp (which counts the same
+	// microseconds as the FIFO stamps) with the host clock.
+	// Stamps are converted by subtracting their age, relative to
+	// the anchor, from the anchor's host time. A stamp newer than
+	// the anchor means the timestamp was reset in between, so it
+	// can't be placed and converts to zero.
+
+	class ClockModel {
+	    Clock::Ticks host;
+	    uint32_t stamp;
+
+	 public:
+	    enum { STAMP_MASK = 0xffffff };
+
+	    ClockModel() : host(0), stamp(0) {}
+
+	    bool isValid() const { return host != 0; }
+
+	    void anchor(Clock::Ticks const t, uint32_t const s)
+	    {
+		host = t;
+		stamp = s & STAMP_MASK;
+	    }
+
+	    Clock::Ticks toHost(uint32_t const s) const
+	    {
+		if (host != 0 && s <= stamp)
+		    return host - Clock::fromMicroseconds(stamp - s);
+		else
+		    return 0;
+	    }
+
+	    // Estimates the hardware stamp at host time `t`. Since
+	    // the model can't see timestamp resets, the estimate is
+	    // only good until the next reset event.
+
+	    uint32_t toStamp(Clock::Ticks const t) const
+	    {
+		if (host == 0 || t <= host)
+		    return stamp;
+
+		uint32_t const us = Clock::toMicroseconds(t - host);
+
+		return us >= uint32_t(STAMP_MASK) - stamp ?
+		    uint32_t(STAMP_MASK) : stamp + us;
+	    }
+	};
+
+	// A list of timed changes to the trigger table, each at an
+	// offset (in microseconds, the units of the FIFO timestamp)
+	// from the start of the supercycle. `compile()` plays the
+	// changes against the current table and keeps only the
+	// writes which change an entry; the table is restored at each
+	// supercycle reset so every cycle starts from the same
+	// state. `HW` steps through the writes as time passes.
+
+	class TriggerSchedule {
+	 public:
+	    struct Write {
+		uint32_t offset;
+		uint16_t value;
+		uint8_t event;
+	    };
+
+	 private:
+	    struct Delta {
+		uint32_t offset;
+		uint16_t mask;
+		uint8_t event;
+		bool enable;
+
+		bool operator<(Delta const& o) const
+		{
+		    return offset < o.offset;
+		}
+	    };
+
+	    std::vector<Delta> deltas;
+	    std::vector<Write> writes;
+
+	    // The restore writes sit at the front of `writes`, with
+	    // offset 0. The first cycle after loading doesn't need
+	    // them, since `compile()` returns the start state
+	    // separately.
+
+	    size_t restore;
+	    size_t pos;
+	    uint32_t last;
+	    bool wrapped;
+
+	 public:
+	    TriggerSchedule() : restore(0), pos(0), last(0), wrapped(false) {}
+
+	    // Adds a change: at `offset` microseconds into the
+	    // supercycle, `event` starts (or stops) activating
+	    // trigger bit `trigBit`.
+
+	    void add(uint32_t const offset, uint8_t const event,
+		     uint8_t const trigBit, bool const enable)
+	    {
+		if (trigBit > 7)
+		    throw std::logic_error("illegal trigger bit value");
+		if (offset > 0xffffff)
+		    throw std::logic_error("schedule offset out of range");
+
+		Delta const d = { offset, uint16_t(1 << trigBit), event,
+				  enable };
+
+		deltas.push_back(d);
+	    }
+
+	    bool empty() const { return deltas.empty(); }
+	    std::vector<Write> const& plan() const { return writes; }
+
+	    // Builds the write list, starting from the trigger table
+	    // `base`. Returns, in `start`, the writes which bring the
+	    // table to its state at the start of the supercycle.
+
+	    void compile(uint16_t const* base, std::vector<Write>& start);
+
+	    void rewind()
+	    {
+		pos = restore;
+		last = 0;
+		wrapped = false;
+	    }
+
+	    // Returns, in `w`, the next write which is due when the
+	    // hardware stamp reads `stamp`. A stamp lower than the last
+	    // one means the supercycle restarted; any writes left
+	    // from the previous cycle are returned first.
+
+	    bool next(uint32_t const stamp, Write& w)
+	    {
+		if (stamp < last)
+		    wrapped = true;
+		last = stamp;
+
+		if (pos == writes.size()) {
+		    if (!wrapped || writes.empty())
+			return false;
+		    pos = 0;
+		    wrapped = false;
+		}
+
+		if (!wrapped && writes[pos].offset > stamp)
+		    return false;
+
+		w = writes[pos++];
+		return true;
+	    }
+	};
+
+	// Places events from several boards on one timeline. Each
+	// board's 24-bit stamps are unwrapped into a 64-bit
+	// microsecond count, using the events' host times to bridge
+	// the timestamp resets. Board 0 is the reference: its
+	// unwrapped time is the timeline. For every other board, an
+	// offset and a drift against the reference are estimated by
+	// matching occurrences of the same event number seen by both
+	// boards within `window` microseconds. The estimate is a
+	// fixed-point alpha-beta loop, so mapping an event costs a
+	// few integer operations (plus a scan of the boards for the
+	// reference's events). Each occurrence is matched at most
+	// once and only pairs inside the window are matched, so
+	// events that repeat faster than the boards' streams are
+	// merged aren't paired with another repetition. A run of
+	// consistent outliers (after a reset seen at slightly
+	// different times, say) re-acquires the offset.
+	//
+	// Like `Histogram`, it expects a single writer, typically the
+	// task merging the boards' streams.
+
+	class TimestampAligner {
+	 public:
+	    enum { MAX_BOARDS = 32 };
+
+	    struct Estimate {
+		int64_t offset;		// nanoseconds, board to reference
+		int32_t drift;		// parts per billion
+		int32_t residual;	// last match error, nanoseconds
+		uint32_t matches;
+		uint32_t steps;		// re-acquisitions
+		bool locked;
+	    };
+
+	 private:
+	    // Fixed point: `offset` is in 1/256 us and `drift` in
+	    // units of 2^-32.
+
+	    struct Board {
+		int64_t base;
+		uint32_t lastStamp;
+		int64_t lastLocal;
+		Clock::Ticks lastHost;
+		bool started;
+
+		int64_t recent[256];
+		int64_t used[256];	// reference occurrences matched
+
+		int64_t offset;
+		int64_t drift;
+		int64_t anchor;
+		int64_t lastMatch;
+		int64_t stepError;	// of the current run of outliers
+		int32_t residual;
+		uint32_t matches;
+		uint32_t steps;
+		uint32_t outliers;
+		bool locked;
+	    };
+
+	    std::vector<Board> board;
+	    int64_t const window;
+
+	    int64_t unwrap(Board&, Event const&);
+	    int64_t predict(Board const&, int64_t) const;
+	    enum Pairing { Unrelated, Outlier, Same };
+
+	    Pairing classify(Board const&, uint8_t e, int64_t local,
+			     int64_t ref) const;
+	    void match(Board&, int64_t local, int64_t ref);
+	    void outlier(Board&, int64_t local, int64_t ref);
+	    void pair(Board&, uint8_t e, int64_t local, int64_t ref);
+
+	 public:
+	    explicit TimestampAligner(size_t boards, uint32_t window = 500);
+
+	    // Feeds an event seen by board `b` and returns its time on
+	    // the common timeline, in microseconds.
+
+	    int64_t align(size_t b, Event const& ev);
+
+	    Estimate estimate(size_t b) const;
+	    void dump() const;
+	};
+
+	// Collects per-stage delivery latencies, in nanoseconds, from
+	// timestamped events. The stages are hardware to interrupt
+	// handler, interrupt handler to drain task, and drain task to
+	// subscriber, along with the hardware-to-drain and end-to-end
+	// totals. Stages whose timestamps are missing are skipped, so
+	// polled readers only fill the drain and subscriber stages.
+	// Like `Histogram`, an instance expects a single writer;
+	// normally the drain task owns it. Subscribers run on several
+	// tasks, so `Executor` keeps one per worker (and one for the
+	// dispatching task) and merges them when asked.
+
+	class LatencyStats {
+	 public:
+	    enum Stage {
+		HwToIsr, IsrToDrain, HwToDrain, DrainToSubscriber,
+		HwToSubscriber, STAGES
+	    };
+
+	 private:
+	    Histogram stage[STAGES];
+
+	    void add(Stage const s, Clock::Ticks const from,
+		     Clock::Ticks const to)
+	    {
+		if (from != 0 && to >= from)
+		    stage[s].record(Clock::toNanoseconds(to - from));
+	    }
+
+	 public:
+	    Histogram const& histogram(Stage const s) const { return stage[s]; }
+
+	    void reset()
+	    {
+		for (size_t ii = 0; ii < STAGES; ++ii)
+		    stage[ii].reset();
+	    }
+
+	    void merge(LatencyStats const& o)
+	    {
+		for (size_t ii = 0; ii < STAGES; ++ii)
+		    stage[ii].merge(o.stage[ii]);
+	    }
+
+	    // Records the stages up to the drain task.
+
+	    void record(Event const& ev)
+	    {
+		add(HwToIsr, ev.arrived, ev.isr);
+		add(IsrToDrain, ev.isr, ev.drained);
+		add(HwToDrain, ev.arrived, ev.drained);
+	    }
+
+	    // Called when a subscriber receives an event. Returns
+	    // the host time of the delivery.
+
+	    Clock::Ticks delivered(Event const& ev)
+	    {
+		Clock::Ticks const now = Clock::now();
+
+		add(DrainToSubscriber, ev.drained, now);
+		add(HwToSubscriber, ev.arrived, now);
+		return now;
+	    }
+
+	    void dump() const;
+	};
+
+	// A binary signal used by the interrupt handler to wake the
+	// task draining events. `raise()` may be called from
+	// interrupt context on VxWorks. `wait()` returns `false` if
+	// the timeout, in milliseconds, expires first.
+
+	class Signal {
+#ifdef __vxworks
+	    SEM_ID const id;
+#else
+	    pthread_mutex_t mtx;
+	    pthread_cond_t cond;
+	    bool raised;
+#endif
+
+	    Signal(Signal const&);
+	    Signal& operator=(Signal const&);
+
+	 public:
+	    Signal();
+	    ~Signal();
+
+	    void raise();
+	    bool wait(uint32_t timeout);
+	};
+
+	// `IPUCD_CACHE_LINE` is the cache line size used to keep state
+	// written on different CPUs apart. VxWorks supplies it for
+	// the target architecture.
+
+#ifndef IPUCD_CACHE_LINE
+#ifdef _CACHE_ALIGN_SIZE
+#define IPUCD_CACHE_LINE _CACHE_ALIGN_SIZE
+#else
+#define IPUCD_CACHE_LINE 64
+#endif
+#endif
+
+#define IPUCD_CACHE_ALIGNED __attribute__((aligned(IPUCD_CACHE_LINE)))
+
+	// A fixed-capacity FIFO of events used to hand entries from
+	// the interrupt handler to the drain task. The storage is
+	// allocated by `resize()` when interrupts are set up; the
+	// capacity is rounded up to a power of two. It does no
+	// locking of its own -- the owner serializes access. The
+	// drain task advances `head` and the handler `tail`, so each
+	// gets its own cache line.
+
+	class EventQueue {
+	    std::vector<Event> slot;
+	    size_t mask;
+	    size_t head IPUCD_CACHE_ALIGNED;
+	    size_t tail IPUCD_CACHE_ALIGNED;
+	    uint32_t dropped;
+
+	 public:
+	    EventQueue() : mask(0), head(0), tail(0), dropped(0) {}
+
+	    void resize(size_t const n)
+	    {
+		size_t cap = 1;
+
+		while (cap < n)
+		    cap <<= 1;
+		slot.resize(cap);
+		mask = cap - 1;
+		head = tail = 0;
+	    }
+
+	    size_t size() const { return tail - head; }
+	    uint32_t overflows() const { return dropped; }
+
+	    // Where the indices live, for layout checks.
+
+	    void const* headAddress() const { return &head; }
+	    void const* tailAddress() const { return &tail; }
+
+	    bool push(Event const& ev)
+	    {
+		if (UNLIKELY(slot.empty() || tail - head > mask)) {
+		    ++dropped;
+		    return false;
+		}
+		slot[tail++ & mask] = ev;
+		return true;
+	    }
+
+	    bool pop(Event& ev)
+	    {
+		if (head == tail)
+		    return false;
+		ev = slot[head++ & mask];
+		return true;
+	    }
+	};
+
+	// Statistics kept by the interrupt handler. `latency` is the
+	// time, in nanoseconds (with microsecond resolution), from
+	// the arrival of the entry that crossed the FIFO threshold to
+	// the handler's entry. `duration` is the handler's run time,
+	// in nanoseconds, and `batch` is the number of entries it
+	// moved per interrupt. Everything is preallocated; only the
+	// handler writes to it.
+
+	struct IsrStats {
+	    Histogram latency;
+	    Histogram duration;
+	    Histogram batch;
+
+	    void reset()
+	    {
+		latency.reset();
+		duration.reset();
+		batch.reset();
+	    }
+
+	    void dump() const;
+	};
+
+	// Results of a loopback calibration run (see
+	// `HW::calibrate()`). All histograms are in nanoseconds.
+	// `missed` counts injected interrupts that didn't reach the
+	// handler, or the waiting task, before the timeout.
+
+	struct Calibration {
+	    Histogram commandToIsr;
+	    Histogram isrToTask;
+	    Histogram commandToTask;
+	    uint32_t missed;
+
+	    Calibration() : missed(0) {}
+
+	    void dump() const;
+	};
+
+	// Identifies the driver operations that hold the board lock,
+	// for the lock profiler.
+
+	enum LockSite {
+	    SiteUnknown, SiteInit, SiteReadFifo, SiteDrain,
+	    SiteAdjustTclkReception, SiteGetTclkReception, SiteGetStatus,
+	    SiteFifoThreshold, SiteFifoTriggers, SiteInterrupts,
+	    SiteCalibrate, SiteSchedule, LOCK_SITES
+	};
+
+	// Wait and hold times, in nanoseconds, of the board lock for
+	// each call site. A lock is charged to the first site that
+	// uses it, which is the operation that caused the caller to
+	// take the lock.
+
+	class LockProfile {
+	    Histogram waitTime[LOCK_SITES];
+	    Histogram holdTime[LOCK_SITES];
+
+	 public:
+	    void record(LockSite const site, uint32_t const wait,
+			uint32_t const hold)
+	    {
+		waitTime[site].record(wait);
+		holdTime[site].record(hold);
+	    }
+
+	    void reset()
+	    {
+		for (size_t ii = 0; ii < LOCK_SITES; ++ii) {
+		    waitTime[ii].reset();
+		    holdTime[ii].reset();
+		}
+	    }
+
+	    void dump() const;
+	};
+
+	// Building with `IPUCD_LOCK_PROFILE` defined replaces the
+	// board lock with one that times itself. Driver methods
+	// name their call site with this macro; it compiles away
+	// otherwise.
+
+#ifdef IPUCD_LOCK_PROFILE
+#define IPUCD_LOCK_SITE(lock, site) (lock).note(site)
+#else
+#define IPUCD_LOCK_SITE(lock, site) ((void) (lock))
+#endif
+
+	// The size of the trace log. `IPUCD_TRACE_DEPTH` is the number
+	// of records kept per CPU and must be a power of two.
+	// `IPUCD_TRACE_CPUS` has to cover every CPU the driver runs
+	// on in SMP builds.
+
+#ifndef IPUCD_TRACE_DEPTH
+#define IPUCD_TRACE_DEPTH 4096
+#endif
+
+#ifndef IPUCD_TRACE_CPUS
+#if defined(__vxworks) && defined(_WRS_CONFIG_SMP)
+#define IPUCD_TRACE_CPUS 4
+#else
+#define IPUCD_TRACE_CPUS 1
+#endif
+#endif
+
+	// Returns `v` and increments it, atomically across CPUs. On
+	// uniprocessor VxWorks targets the interrupt lock suffices;
+	// SMP ones need `vxAtomicInc()`, since `intCpuLock()` only
+	// keeps out the local CPU.
+
+	inline uint32_t fetchAndIncrement(uint32_t volatile& v)
+	{
+#if defined(__vxworks) && defined(_WRS_CONFIG_SMP)
+	    return uint32_t(vxAtomicInc(reinterpret_cast<atomic_t*>(
+			const_cast<uint32_t*>(&v))));
+#elif defined(__vxworks)
+	    IntLock const lock;
+
+	    return v++;
+#else
+	    return __sync_fetch_and_add(&v, 1);
+#endif
+	}
+
+	// Checks that the per-event paths never touch the heap; every
+	// buffer they use is sized when the driver is set up. The
+	// drain, dispatch and alignment entry points each open a
+	// `HeapCheck::Scope`. In builds with `IPUCD_HEAP_CHECK`,
+	// ip-ucd.cpp replaces the global `operator new` and every
+	// allocation a task makes while inside a scope is counted and
+	// passed to the installed hook, so a test (heapcheck.cpp)
+	// can fail, or a target can freeze the trace log, on the
+	// first one. Other builds compile the scopes away, and
+	// `active()` is always false.
+
+	class HeapCheck {
+	 public:
+	    typedef void (*Hook)(size_t bytes);
+
+	 private:
+#ifdef IPUCD_HEAP_CHECK
+	    static __thread unsigned depth;
+#endif
+	    static uint32_t count;
+	    static Hook hook;
+
+	 public:
+#ifdef IPUCD_HEAP_CHECK
+	    class Scope {
+		Scope(Scope const&);
+		Scope& operator=(Scope const&);
+
+	     public:
+		Scope() { ++depth; }
+		~Scope() { --depth; }
+	    };
+
+	    static bool active() { return depth != 0; }
+
+	    // Called by the replacement `operator new`. The hook runs
+	    // outside the scope, so it may allocate.
+
+	    static void allocated(size_t bytes);
+#else
+	    static bool active() { return false; }
+#endif
+
+	    static uint32_t violations() { return count; }
+	    static void reset() { count = 0; }
+	    static void setHook(Hook const fn) { hook = fn; }
+	};
+
+#ifdef IPUCD_HEAP_CHECK
+#define IPUCD_NO_HEAP HeapCheck::Scope const noHeap
+#else
+#define IPUCD_NO_HEAP ((void) 0)
+#endif
+
+	// Operations recorded in the trace log. The meaning of the
+	// two arguments depends on the operation:
+	//
+	//   TraceRegRead, TraceRegWrite: register offset, value
+	//   TraceDrainBegin: -, entries requested
+	//   TraceDrainEnd: -, entries drained
+	//   TraceIsrEntry: -, -
+	//   TraceIsrExit: -, entries moved
+	//   TraceConfig: event or trigger bit, new value
+	//   TraceStatus, TraceFault: -, status register
+
+	enum TraceOp {
+	    TraceNone, TraceRegRead, TraceRegWrite, TraceDrainBegin,
+	    TraceDrainEnd, TraceIsrEntry, TraceIsrExit, TraceConfig,
+	    TraceStatus, TraceFault, TRACE_OPS
+	};
+
+	// A trace record is 16 bytes: the host time, the operation,
+	// the board (its A16 offset divided by 256, which is its
+	// carrier slot) and two arguments.
+
+	struct TraceRecord {
+	    Clock::Ticks time;
+	    uint8_t op;
+	    uint8_t board;
+	    uint16_t arg0;
+	    uint32_t arg1;
+	};
+
+	// A flight recorder of driver operations. Each CPU has its
+	// own ring of fixed-size records in static storage. Claiming
+	// a slot only locks interrupts on the local CPU for one
+	// increment, so recording is safe from interrupt handlers
+	// and costs a few tens of nanoseconds. When `freeze()` is
+	// called -- automatically on a fault, if armed -- recording
+	// stops so the history leading up to the problem is kept
+	// until it's dumped.
+
+	class TraceLog {
+	 public:
+	    enum { DEPTH = IPUCD_TRACE_DEPTH, CPUS = IPUCD_TRACE_CPUS };
+
+	 private:
+	    // Each ring starts a cache line, so CPUs claiming slots
+	    // in their own rings don't share `next`.
+
+	    struct Ring {
+		uint32_t next;
+		TraceRecord rec[DEPTH];
+	    } IPUCD_CACHE_ALIGNED;
+
+	    static Ring ring[CPUS];
+	    static bool volatile frozen;
+	    static bool freezeOnFault;
+
+	    static TraceRecord& claim()
+	    {
+#ifdef __vxworks
+		IntLock const lock;
+#ifdef _WRS_CONFIG_SMP
+		Ring& r = ring[vxCpuIndexGet()];
+#else
+		Ring& r = ring[0];
+#endif
+
+		return r.rec[r.next++ & (DEPTH - 1)];
+#else
+		Ring& r = ring[0];
+
+		return r.rec[__sync_fetch_and_add(&r.next, 1) & (DEPTH - 1)];
+#endif
+	    }
+
+	 public:
+	    static void record(TraceOp const op, uint8_t const board,
+			       uint16_t const arg0 = 0, uint32_t const arg1 = 0)
+	    {
+		if (UNLIKELY(frozen))
+		    return;
+
+		TraceRecord& rec = claim();
+
+		rec.time = Clock::now();
+		rec.op = op;
+		rec.board = board;
+		rec.arg0 = arg0;
+		rec.arg1 = arg1;
+	    }
+
+	    // Records a fault and, if armed, freezes the log.
+
+	    static void fault(uint8_t const board, uint32_t const status)
+	    {
+		record(TraceFault, board, 0, status);
+		if (freezeOnFault)
+		    frozen = true;
+	    }
+
+	    static void armFreezeOnFault(bool const arm) { freezeOnFault = arm; }
+	    static void freeze() { frozen = true; }
+	    static void thaw() { frozen = false; }
+	    static bool isFrozen() { return frozen; }
+
+	    // Copies up to `n` of the newest records, from all CPUs
+	    // and sorted by time, into `buf`. Returns the number
+	    // copied. Freeze the log first for a consistent copy.
+
+	    static size_t snapshot(TraceRecord* buf, size_t n);
+
+	    // Prints the newest `last` records (all of them if zero)
+	    // with times relative to the oldest one printed.
+
+	    static void dump(size_t last = 0);
+
+	    // Writes the log to `file` in binary form: the 8-byte
+	    // magic "IPUCDTRC", a 32-bit version, the 32-bit tick
+	    // frequency and record count, then the records in host
+	    // byte order.
+
+	    static bool save(char const* file);
+	};
 
-namespace vwpp {
-    namespace v3_0 {
-	namespace VME {
-	    using namespace IPUCD::v1_0;
+	// One recorded bus access: the window's bus address, the byte
+	// offset in the window, the address space, the access width
+	// in bytes (low nibble of `flags`) with `BUS_WRITE` set for
+	// writes, and the value. Wide registers which the hardware
+	// reads in pieces (`FifoEntry`) are recorded as one access.
 
-	    // This template allows us to define a virtual register
-	    // that returns `FifoEntry` objects. The hardware actually
-	    // requires two, 16-bit reads to obtain the entry. The
-	    // registers are assumed to be adjacent and the offset is
-	    // assumed to be of the lower addressed register.
+	struct BusAccess {
+	    enum { BUS_WRITE = 0x80 };
 
-	    template <size_t Offset, ReadAccess R>
-	    struct Register<A32, FifoEntry, Offset, R, NoWrite> {
-		typedef FifoEntry Type;
-		typedef uint16_t AtomicType;
+	    uint32_t base;
+	    uint16_t offset;
+	    uint8_t space;
+	    uint8_t flags;
+	    uint32_t value;
+	};
 
-		static AddressSpace const space = A32;
+	// Converts register values to and from the 32-bit values kept
+	// in a bus trace.
 
-		enum { RegOffset = Offset, RegEntries = 1 };
+	template <typename T>
+	struct BusValue {
+	    static uint32_t to(T const v) { return uint32_t(v); }
+	    static T from(uint32_t const v) { return T(v); }
+	};
 
-		static Type read(uint8_t volatile* const base)
-		{
-		    typedef ReadAPI<AtomicType, Offset, R> API;
+	template <>
+	struct BusValue<FifoEntry> {
+	    static uint32_t to(FifoEntry const& v) { return v.raw(); }
+	    static FifoEntry from(uint32_t const v) { return FifoEntry(v); }
+	};
+
+	// Records every register access the driver makes, in order,
+	// and plays the recorded read values back in place of the
+	// hardware. Replaying a production trace measures the
+	// driver's own CPU cost without bus latency, and different
+	// driver versions can be compared on the same input.
+	//
+	// Only builds with `IPUCD_BUS_TRACE` defined route accesses
+	// through here; otherwise the register layer is untouched.
+	// Replay hands out records in the global order they were
+	// recorded, so it's meant for a single task driving the
+	// boards. Once the trace is used up, reads return all ones
+	// (an empty FIFO). Block transfers go through the carrier's
+	// routine rather than the register layer, so `drain()` reads
+	// the FIFO one entry at a time while a trace is recorded or
+	// replayed.
+
+	class BusTrace {
+	 public:
+	    enum Mode { Off, Record, Replay };
+
+	 private:
+	    static std::vector<BusAccess> trace;
+	    static uint32_t next;
+	    static uint32_t count;
+	    static uint32_t mismatches;
+	    static uint32_t overruns;
+
+	 public:
+	    static Mode volatile mode;
+
+	    // Starts recording into a buffer of `capacity` accesses;
+	    // accesses beyond that are counted and dropped.
+
+	    static void startRecording(size_t capacity);
+
+	    // Rewinds the recorded (or loaded) trace and switches
+	    // the register layer to replay.
+
+	    static void startReplay();
+
+	    static void stop() { mode = Off; }
+
+	    static size_t size() { return count; }
+	    static uint32_t mismatchCount() { return mismatches; }
+	    static uint32_t overrunCount() { return overruns; }
+
+	    static void record(uint8_t const space, uint32_t const base,
+			       uint16_t const offset, uint8_t const flags,
+			       uint32_t const value)
+	    {
+		uint32_t const idx = fetchAndIncrement(next);
+
+		if (UNLIKELY(idx >= trace.size())) {
+		    ++overruns;
+		    return;
+		}
+
+		BusAccess& a = trace[idx];
+
+		a.base = base;
+		a.offset = offset;
+		a.space = space;
+		a.flags = flags;
+		a.value = value;
+		count = std::max(count, idx + 1);
+	    }
+
+	    // Returns the value of the next recorded access, which
+	    // should match the one described. Mismatches (the driver
+	    // took a different path from the recording) are counted.
+
+	    static uint32_t replay(uint8_t space, uint32_t base,
+				   uint16_t offset, uint8_t flags);
+
+	    // Saves the trace to `file`: the 8-byte magic
+	    // "IPUCDBUS", a 32-bit version and access count, then the
+	    // accesses in host byte order. `load()` reads it back for
+	    // replay.
+
+	    static bool save(char const* file);
+	    static bool load(char const* file);
+	};
+
+	// A register window which sends its accesses through
+	// `BusTrace`. It wraps a vwpp `Memory` with the same
+	// interface; with the trace off, each access costs one extra
+	// test.
+
+	template <typename M, VME::AddressSpace S>
+	class BusMemory {
+	    M const mem;
+	    uint32_t const base;
+
+	    template <typename R>
+	    static uint16_t offsetOf(size_t const idx)
+	    {
+		return uint16_t(R::RegOffset + idx * sizeof(typename R::Type));
+	    }
+
+	    template <typename R>
+	    static uint8_t flagsOf(bool const write)
+	    {
+		return uint8_t(sizeof(typename R::Type) |
+			       (write ? BusAccess::BUS_WRITE : 0));
+	    }
+
+	    template <typename R>
+	    typename R::Type traced(typename R::Type const v, size_t const idx) const
+	    {
+		BusTrace::record(S, base, offsetOf<R>(idx), flagsOf<R>(false),
+				 BusValue<typename R::Type>::to(v));
+		return v;
+	    }
 
-		    uint32_t tmp = API::readMem(base, 0);
+	    template <typename R>
+	    typename R::Type replayed(size_t const idx) const
+	    {
+		return BusValue<typename R::Type>::from(
+		    BusTrace::replay(S, base, offsetOf<R>(idx),
+				     flagsOf<R>(false)));
+	    }
 
-		    return FifoEntry((tmp << 16) | API::readMem(base, 1));
+	    template <typename R>
+	    bool written(typename R::Type const v, size_t const idx) const
+	    {
+		if (BusTrace::mode == BusTrace::Replay) {
+		    BusTrace::replay(S, base, offsetOf<R>(idx), flagsOf<R>(true));
+		    return true;
 		}
+		BusTrace::record(S, base, offsetOf<R>(idx), flagsOf<R>(true),
+				 BusValue<typename R::Type>::to(v));
+		return false;
+	    }
+
+	 public:
+	    explicit BusMemory(size_t const offset) :
+		mem(offset), base(uint32_t(offset))
+	    {
+	    }
+
+	    template <typename R, typename L>
+	    typename R::Type get(L const& lock) const
+	    {
+		if (LIKELY(BusTrace::mode == BusTrace::Off))
+		    return mem.template get<R>(lock);
+		if (BusTrace::mode == BusTrace::Replay)
+		    return replayed<R>(0);
+		return traced<R>(mem.template get<R>(lock), 0);
+	    }
+
+	    template <typename R, typename L>
+	    void set(L const& lock, typename R::Type const v) const
+	    {
+		if (UNLIKELY(BusTrace::mode != BusTrace::Off) &&
+		    written<R>(v, 0))
+		    return;
+		mem.template set<R>(lock, v);
+	    }
+
+	    template <typename R, typename L>
+	    typename R::Type get_element(L const& lock, size_t const idx) const
+	    {
+		if (LIKELY(BusTrace::mode == BusTrace::Off))
+		    return mem.template get_element<R>(lock, idx);
+		if (BusTrace::mode == BusTrace::Replay)
+		    return replayed<R>(idx);
+		return traced<R>(mem.template get_element<R>(lock, idx), idx);
+	    }
+
+	    template <typename R, typename L>
+	    void set_element(L const& lock, size_t const idx,
+			     typename R::Type const v) const
+	    {
+		if (UNLIKELY(BusTrace::mode != BusTrace::Off) &&
+		    written<R>(v, idx))
+		    return;
+		mem.template set_element<R>(lock, idx, v);
+	    }
+	};
+
+	// Picks the type of a register window: a plain vwpp `Memory`
+	// or, in builds with `IPUCD_BUS_TRACE`, one wrapped by
+	// `BusMemory`.
+
+	template <VME::AddressSpace S, VME::DataAccess D, size_t Size,
+		  typename Lock>
+	struct BusView {
+#ifdef IPUCD_BUS_TRACE
+	    typedef BusMemory<VME::Memory<S, D, Size, Lock>, S> Type;
+#else
+	    typedef VME::Memory<S, D, Size, Lock> Type;
+#endif
+	};
+
+	// One slot of the broadcast ring. It's also the wire format
+	// of the event server, so its layout is fixed: 48 bytes with
+	// the 64-bit fields naturally aligned. `seq` is the sequence
+	// number of the event held in the slot and `check` a second
+	// copy of it, after the data. The producer complements both
+	// before touching the data and restores them afterwards, so
+	// a copy made front to back while the slot is rewritten ends
+	// up with two different values.
+
+	struct BroadcastSlot {
+	    uint32_t seq;
+	    uint8_t board;
+	    uint8_t reserved[3];
+	    uint32_t raw;
+	    uint32_t pad;
+	    uint64_t arrived;
+	    uint64_t isr;
+	    uint64_t drained;
+	    uint32_t check;
+	    uint32_t pad2;
+	};
+
+	// A single-producer ring that any number of readers follow
+	// by sequence number, without locks and without slowing down
+	// the producer. A reader that falls more than `capacity`
+	// events behind loses the overwritten ones; it detects this
+	// because a slot's `seq` no longer matches the sequence
+	// number it expects. The ring is a header followed by the
+	// slots in one block of memory.
+	//
+	// On hosted builds the block can be a POSIX shared memory
+	// object so other processes can follow the ring with
+	// `BroadcastReader` -- no system call or copy per event.
+	// Readers check the header's magic, version and slot size
+	// before trusting the layout; any change to the layout must
+	// bump `VERSION`.
+
+	class BroadcastRing {
+	 public:
+	    struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t capacity;
+		uint32_t slotSize;
+		uint32_t volatile head;
 	    };
-	}
-    }
-}
 
-namespace IPUCD {
-    namespace v1_0 {
-	using namespace vwpp::v3_0;
+	    enum { VERSION = 2 };
 
-	// A helper template to define "registers" that reside in the
-	// Industry Pack's PROM space (like module IDs.) To define a
-	// location, you only need to specify an offset.
+	 private:
+	    std::string const shm;
+	    Header* const hdr;
+	    BroadcastSlot* const slot;
+	    uint32_t const mask;
 
-	template <size_t Offset>
-	struct PROM
-	    : public VME::Register<VME::A16, uint8_t, Offset, VME::Read, VME::NoWrite>
-	{};
+	    BroadcastRing(BroadcastRing const&);
+	    BroadcastRing& operator=(BroadcastRing const&);
 
-	// This is a common definition type for "config" registers;
-	// registers that change the behavior of the hardware. THey
-	// all are readable and writable but they all require a
-	// confirmed write.
+	    static size_t bytes(size_t capacity);
+	    static Header* allocate(size_t capacity);
+#ifndef __vxworks
+	    static Header* share(char const* name, size_t capacity);
+#endif
+	    void init(size_t capacity);
 
-	template <typename T, size_t Offset>
-	struct ConfigReg
-	    : public VME::Register<VME::A16, T, Offset, VME::Read, VME::ConfirmWrite>
-	{};
+	 public:
+	    // Allocates a ring of `capacity` slots, which must be a
+	    // power of two.
 
-	// Define control register commands.
+	    explicit BroadcastRing(size_t capacity);
 
-	enum ControlCommand {
-	    NoOp = 0x0,
-	    EnableTCLK = 0x1,
-	    DisableTCLK = 0x2,
-	    EnableMDAT = 0x3,
-	    DisableMDAT = 0x4,
-	    MDAT_Buf0 = 0x5,
-	    MDAT_Buf1 = 0x6,
-	    EnableMDAT_BufAuto = 0x7,
-	    DisableMDAT_BufAuto = 0x8,
-	    SW_Interrupt = 0x9,
-	    SW_Reset = 0xff
+#ifndef __vxworks
+	    // Creates the ring in the shared memory object `name`
+	    // (for example, "/ipucd"), replacing any existing one.
+	    // The object is unlinked when the ring is destroyed.
+
+	    BroadcastRing(char const* name, size_t capacity);
+#endif
+	    ~BroadcastRing();
+
+	    uint32_t capacity() const { return mask + 1; }
+	    Header const* header() const { return hdr; }
+
+	    // The sequence number the next event will get. Events
+	    // `head() - capacity()` through `head() - 1` are
+	    // available.
+
+	    uint32_t head() const { return hdr->head; }
+
+	    void publish(uint8_t const board, Event const& ev)
+	    {
+		uint32_t const seq = hdr->head;
+		BroadcastSlot& s = slot[seq & mask];
+
+		s.seq = ~seq;
+		s.check = ~seq;
+		IPUCD_BARRIER();
+		s.board = board;
+		s.raw = ev.entry.raw();
+		s.arrived = ev.arrived;
+		s.isr = ev.isr;
+		s.drained = ev.drained;
+		IPUCD_BARRIER();
+		s.check = seq;
+		s.seq = seq;
+		IPUCD_BARRIER();
+		hdr->head = seq + 1;
+	    }
+
+	    // Returns the slot that holds (or held) event `seq`. The
+	    // caller has to check its `seq` field after using it.
+
+	    BroadcastSlot const& at(uint32_t const seq) const
+	    {
+		return slot[seq & mask];
+	    }
+
+	    // Copies event `seq` into `out`. Returns `false` if the
+	    // event hasn't been published or was overwritten.
+
+	    bool read(uint32_t const seq, BroadcastSlot& out) const
+	    {
+		return copy(at(seq), seq, out);
+	    }
+
+	    static bool copy(BroadcastSlot const& s, uint32_t const seq,
+			     BroadcastSlot& out)
+	    {
+		if (s.seq != seq)
+		    return false;
+		IPUCD_BARRIER();
+		out = s;
+		IPUCD_BARRIER();
+		return s.seq == seq && out.seq == seq && out.check == seq;
+	    }
+	};
+
+	// One reader's position in a broadcast ring. A new cursor
+	// starts with the next event to be published. Any number of
+	// cursors can follow the same ring.
+
+	class BroadcastCursor {
+	    BroadcastRing::Header const* const hdr;
+	    BroadcastSlot const* const slot;
+	    uint32_t const mask;
+	    uint32_t seq;
+	    uint32_t dropped;
+
+	 public:
+	    explicit BroadcastCursor(BroadcastRing::Header const* const h) :
+		hdr(h), slot(reinterpret_cast<BroadcastSlot const*>(h + 1)),
+		mask(h->capacity - 1), seq(h->head), dropped(0)
+	    {}
+
+	    explicit BroadcastCursor(BroadcastRing const& ring) :
+		hdr(ring.header()),
+		slot(reinterpret_cast<BroadcastSlot const*>(hdr + 1)),
+		mask(hdr->capacity - 1), seq(hdr->head), dropped(0)
+	    {}
+
+	    // Copies the next event into `out`. Returns `false` if
+	    // there isn't one yet. Events overwritten before they
+	    // were read are skipped and counted by `lost()`.
+
+	    bool next(BroadcastSlot& out)
+	    {
+		for (;;) {
+		    uint32_t const head = hdr->head;
+
+		    if (seq == head)
+			return false;
+		    if (head - seq > mask + 1) {
+			dropped += head - (mask + 1) - seq;
+			seq = head - (mask + 1);
+		    }
+		    if (BroadcastRing::copy(slot[seq & mask], seq, out)) {
+			++seq;
+			return true;
+		    }
+		    ++dropped;
+		    ++seq;
+		}
+	    }
+
+	    uint32_t lost() const { return dropped; }
+	};
+
+#ifndef __vxworks
+
+	// Follows a broadcast ring created in shared memory by
+	// another process. The ring is mapped read-only; reading
+	// only touches the shared memory.
+
+	class BroadcastReader {
+	    size_t size;
+	    BroadcastRing::Header const* const hdr;
+	    BroadcastCursor cursor;
+
+	    BroadcastReader(BroadcastReader const&);
+	    BroadcastReader& operator=(BroadcastReader const&);
+
+	 public:
+	    explicit BroadcastReader(char const* name);
+	    ~BroadcastReader();
+
+	    bool next(BroadcastSlot& out) { return cursor.next(out); }
+	    uint32_t lost() const { return cursor.lost(); }
+	};
+
+#endif
+
+	// The contents of a module's IP ID PROM which identify it.
+
+	struct Identity {
+	    uint8_t manufacturer;
+	    uint8_t model;
+	    uint8_t revision;
+
+	    uint16_t moduleId() const
+	    {
+		return uint16_t((manufacturer << 8) | model);
+	    }
+	};
+
+	// What a board revision supports beyond the basic register
+	// set. Anything not known to work is assumed not to, so an
+	// unknown revision gets the paths every board supports.
+
+	struct Capabilities {
+	    bool fifo32;	// the FIFO may be read with one D32 access
+	    bool blockTransfer;	// the FIFO may be read by block transfer
 	};
 
+	// Looks up the capabilities of a board revision in the
+	// driver's table. Add a revision to the table only once it
+	// has been verified on the bench.
+
+	Capabilities lookupCapabilities(Identity const&);
+
 	// Provides an API to control and interface an IP-UCD industry
 	// pack. An instance of this class is self-contained in that
 	// it will provide serialization primitives so that it can
@@ -114,8 +1724,93 @@ namespace IPUCD {
 
 	    Mutex mutex;
 
+#ifdef IPUCD_LOCK_PROFILE
+
+	    // The profiling lock. `Start` is the first base class so
+	    // its timestamp is taken before the mutex is requested.
+	    // The destructor records the times before the base class
+	    // releases the mutex, so the profile is protected by the
+	    // lock it measures.
+
+	    struct Start {
+		Clock::Ticks const requested;
+
+		Start() : requested(Clock::now()) {}
+	    };
+
+	    class ProfiledLock :
+		private Start, public Mutex::PMLockWithInt<HW, &HW::mutex>
+	    {
+		HW* const hw;
+		Clock::Ticks const acquired;
+		mutable LockSite site;
+
+	     public:
+		explicit ProfiledLock(HW* const o) :
+		    Mutex::PMLockWithInt<HW, &HW::mutex>(o), hw(o),
+		    acquired(Clock::now()), site(SiteUnknown)
+		{}
+
+		~ProfiledLock()
+		{
+		    hw->profile.record(site,
+				       Clock::toNanoseconds(acquired - requested),
+				       Clock::toNanoseconds(Clock::now() - acquired));
+		}
+
+		void note(LockSite const s) const
+		{
+		    if (site == SiteUnknown)
+			site = s;
+		}
+	    };
+
+	    LockProfile profile;
+
+	 public:
+	    typedef ProfiledLock LockType;
+
+	    // Prints the lock profile. The profile is copied while
+	    // holding the lock and printed after releasing it.
+
+	    void dumpLockProfile(bool const reset = false)
+	    {
+		LockProfile copy;
+
+		{
+		    LockType const lock(this);
+
+		    copy = profile;
+		    if (reset)
+			profile.reset();
+		}
+		copy.dump();
+	    }
+#else
 	 public:
 	    typedef Mutex::PMLockWithInt<HW, &HW::mutex> LockType;
+#endif
+
+	 public:
+	    // The ways the driver can read the FIFO, slowest first.
+
+	    enum DrainPath { DrainD16, DrainD32, DrainBlock };
+
+	    // Reads `count` 32-bit FIFO entries from the A32 bus
+	    // address `addr` into `dst` in one block transfer (or DMA)
+	    // without incrementing the address. Returns the number of
+	    // entries read, or -1 if the transfer failed. Supplied by
+	    // the carrier's glue code.
+
+	    typedef int (*BlockRead)(void* ctx, uint32_t addr,
+				     uint32_t* dst, size_t count);
+
+	    struct BlockStats {
+		uint32_t transfers;
+		uint32_t entries;
+		uint32_t failures;
+		uint32_t empty;		// words that read as an empty FIFO
+	    };
 
 	 private:
 
@@ -124,8 +1819,23 @@ namespace IPUCD {
 	    // state of the hardware. The A32 memory holds the
 	    // incoming TCLK events with their timestamps.
 
-	    typedef VME::Memory<VME::A16, VME::D8_D16, 0x100, LockType> A16;
-	    typedef VME::Memory<VME::A32, VME::D16, 0x2000, LockType> A32;
+	    typedef BusView<VME::A16, VME::D8_D16, 0x100, LockType>::Type A16;
+	    typedef BusView<VME::A32, VME::D16, 0x2000, LockType>::Type A32;
+
+	    // The same A32 window, for D32 reads of the FIFO. It's
+	    // only used when `drainPath` is `DrainD32`.
+
+	    typedef BusView<VME::A32, VME::D32, 0x2000, LockType>::Type A32D32;
+
+	    // The interrupt handler can't take the mutex, so it gets
+	    // its own view of the hardware which only requires an
+	    // interrupt lock. On our (uniprocessor) targets, holding
+	    // `LockType` also locks interrupts, so the handler never
+	    // runs while a task is accessing the board.
+
+	    typedef BusView<VME::A16, VME::D8_D16, 0x100, IntLock>::Type IsrA16;
+	    typedef BusView<VME::A32, VME::D16, 0x2000, IntLock>::Type IsrA32;
+	    typedef BusView<VME::A32, VME::D32, 0x2000, IntLock>::Type IsrA32D32;
 
 	    // Define the registers in A16 space.
 
@@ -140,13 +1850,149 @@ namespace IPUCD {
 	    // Define registers in A32 space.
 
 	    typedef VME::Register<VME::A32, uint16_t[256], 0x0, VME::Read, VME::ConfirmWrite> regTrigger;
-	    typedef VME::Register<VME::A32, FifoEntry, 0x1200, VME::DestructiveRead, VME::NoWrite> regFifo;
+
+	    // A FIFO entry takes two, 16-bit reads, high word first,
+	    // or one D32 read on carriers and board revisions that
+	    // support it.
+
+	    typedef WideRegister<VME::A32, FifoEntry, 0x1200, 0x1202, VME::DestructiveRead> regFifo;
+	    typedef WideRegister<VME::A32, FifoEntry, 0x1200, 0x1202, VME::DestructiveRead, SingleCycle> regFifoD32;
+
+	    // The data members are grouped by who writes them, and
+	    // each group starts a cache line (`HW` objects are
+	    // allocated on one), so a CPU updating one group doesn't
+	    // steal the lines of another. The mutex (and lock
+	    // profile) come first. Then the drain path's state,
+	    // touched for every entry or batch, followed by the state
+	    // the interrupt handler writes. Configuration and
+	    // identification, which only change when the board is
+	    // set up, come last.
+
+	    // --- Drain state. ---
 
 	    // Define the actual memory space objects which will
 	    // control access to the hardware.
 
-	    A16 const a16;
+	    A16 const a16 IPUCD_CACHE_ALIGNED;
 	    A32 const a32;
+	    A32D32 const a32d32;
+
+	    // Identifies the board in trace records.
+
+	    uint8_t const board;
+
+	    // The FIFO read path chosen from the board's capabilities.
+	    // `wideFifo` says whether single entries are read with one
+	    // D32 cycle.
+
+	    DrainPath drainPath;
+	    bool wideFifo;
+
+	    // When `timing` is set, `drain()` stamps events with host
+	    // times. The clock model is re-anchored once per drained
+	    // batch.
+
+	    bool timing;
+	    ClockModel clock;
+
+	    // The last threshold written by `setFifoThreshold()`, or
+	    // zero if it was never set.
+
+	    uint8_t fifoThreshold;
+
+	    // Virtual FIFOs, one per trigger bit, filled by `drain()`
+	    // once `enableTriggerDemux()` has been called.
+
+	    BroadcastRing* demux[8];
+
+	    // The block-transfer hook, its bounce buffer and
+	    // counters. The bus address of the FIFO is kept for the
+	    // hook.
+
+	    uint32_t const fifoAddr;
+	    BlockRead blockRead;
+	    void* blockCtx;
+	    std::vector<uint32_t> blockBuf;
+	    BlockStats blockStats;
+
+	    // The loaded trigger schedule and the most writes it may
+	    // make per call to `runTriggerSchedule()`.
+
+	    TriggerSchedule schedule;
+	    size_t scheduleBatch;
+
+	    // Adjusts the FIFO threshold from the rate at which
+	    // entries are read. It's disabled until
+	    // `enableThresholdTuning()` is called. The polled drain
+	    // path feeds it every entry; in interrupt mode the
+	    // handler does, while the drain task leaves it alone.
+
+	    ThresholdTuner tuner;
+
+	    // A shadow copy of the trigger table, kept up to date by
+	    // every write the driver makes to it. `route()` reads it
+	    // for every drained event.
+
+	    uint16_t triggers[regTrigger::RegEntries];
+
+	    // --- Interrupt state. ---
+
+	    IsrA16 const isrA16 IPUCD_CACHE_ALIGNED;
+	    IsrA32 const isrA32;
+	    IsrA32D32 const isrA32d32;
+
+	    // The handler empties the FIFO into `pending` and raises
+	    // `ready`. While a calibration run is in progress it also
+	    // raises `probe`.
+
+	    bool interruptMode;
+	    bool probing;
+	    EventQueue pending;
+	    Signal ready;
+	    Signal probe;
+	    uint32_t interrupts;
+	    Clock::Ticks lastIsr;
+	    IsrStats isrStats;
+
+	    // --- Configuration. ---
+
+	    // What the board is and what it can do.
+
+	    Identity identity IPUCD_CACHE_ALIGNED;
+	    Capabilities caps;
+
+	 public:
+	    // `HW` objects are allocated on a cache line boundary;
+	    // the global allocator only guarantees the alignment of
+	    // the fundamental types.
+
+	    static void* operator new(size_t size);
+	    static void operator delete(void* ptr);
+
+	    // Where each group of data members starts, in bytes from
+	    // the start of the object, so the layout can be checked
+	    // against the cache line size.
+
+	    struct Layout {
+		size_t drain;
+		size_t interrupt;
+		size_t config;
+		size_t size;
+
+		// Members whose placement matters on their own: the
+		// tuner and trigger shadow belong to the drain group,
+		// and the two ends of the interrupt queue must not
+		// share a line.
+
+		size_t tuner;
+		size_t triggers;
+		size_t pendingHead;
+		size_t pendingTail;
+	    };
+
+	    Layout layout() const;
+
+	 private:
 
 	    // --- Define some private, helper methods. ---
 
@@ -170,56 +2016,240 @@ namespace IPUCD {
 		TclkPresent =		0x0001
 	    };
 
-	    // Returns the module ID located in the standard PROM
-	    // area. This method defines it own, local typedefs since
-	    // the module ID locations shouldn't be used by any other
-	    // function. Since they are from unchanging, ROM contents,
-	    // we don't worry about which way the compiler decides to
-	    // calculate the return expression.
+	    // Returns the identity located in the standard PROM
+	    // area. This method defines it own, local typedefs since
+	    // the PROM locations shouldn't be used by any other
+	    // function.
+
+	    Identity readIdentity(LockType const& lock)
+	    {
+		IPUCD_LOCK_SITE(lock, SiteInit);
+
+		typedef PROM<0x89> regManufacturer;
+		typedef PROM<0x8b> regModel;
+		typedef PROM<0x8d> regRevision;
+
+		Identity const id = {
+		    a16.get<regManufacturer>(lock),
+		    a16.get<regModel>(lock),
+		    a16.get<regRevision>(lock)
+		};
+
+		return id;
+	    }
+
+	    // Picks the fastest FIFO read path the board's
+	    // capabilities allow. Defining `IPUCD_FIFO_D32` forces
+	    // D32 FIFO reads, for builds that only run on carriers and
+	    // revisions known to support them.
+
+	    void selectDrainPath()
+	    {
+#ifdef IPUCD_FIFO_D32
+		wideFifo = true;
+#else
+		wideFifo = caps.fifo32;
+#endif
+		if (caps.blockTransfer && blockRead)
+		    drainPath = DrainBlock;
+		else
+		    drainPath = wideFifo ? DrainD32 : DrainD16;
+	    }
+
+	    // The threshold currently programmed into the board, or
+	    // zero if it's unknown.
+
+	    uint8_t currentThreshold() const
+	    {
+		return tuner.isEnabled() ? tuner.threshold() : fifoThreshold;
+	    }
+
+	    // Moves whole threshold-sized blocks from the FIFO into
+	    // `buf`. The threshold status bit should guarantee at
+	    // least that many entries, so a block doesn't read past
+	    // the data (the reads are destructive); if it does, the
+	    // words that read as an empty FIFO are counted and
+	    // dropped. Returns the number of entries stored; the
+	    // caller reads any remainder one at a time.
+
+	    size_t blockDrain(LockType const&, Event* buf, size_t n);
+
+#ifndef __vxworks
+	    // Stands in for carrier DMA off-target, reading the
+	    // register one entry at a time.
+
+	    static int emulateBlockRead(void*, uint32_t, uint32_t*, size_t);
+#endif
+
+	    // The FTP timestamp registers don't hold a plain 32-bit
+	    // value; this joins them.
+
+	    struct FtpWords {
+		static uint32_t compose(uint32_t const hi, uint32_t const lo)
+		{
+		    return (lo >> 4) + (hi << 4);
+		}
+	    };
+
+	    // Returns the 32-bit, microsecond timestamp. This value
+	    // is assembled from two 16-bit accesses, so we
+	    // encapsulate the access through this method. Since
+	    // accessing half of the timestamp isn't useful, the
+	    // register definition is local to this function, making
+	    // all 32-bit timestamp requests go through this method.
+	    // (It's a template so the interrupt handler can use it
+	    // with its own view of the hardware.)
+
+	    template <typename Lock, typename M16>
+	    static uint32_t ftpTimestamp(M16 const& m16, Lock const& lock)
+	    {
+		typedef WideRegister<VME::A16, uint32_t, 0x48, 0x46, VME::Read, LowWordFirst, Unverified, FtpWords> regFtpTS;
+
+		return m16.template get<regFtpTS>(lock);
+	    }
+
+	    uint32_t getFtpTimestamp(LockType const& lock) {
+		return ftpTimestamp(a16, lock);
+	    }
 
-	    uint16_t getModuleId(LockType const& lock)
+	    void setupInterrupt(IntLock const&)
 	    {
-		typedef PROM<0x89> regIdHigh;
-		typedef PROM<0x8b> regIdLow;
+	    }
 
-		return ((uint16_t) a16.get<regIdHigh>(lock) << 8) +
-		    (uint16_t) a16.get<regIdLow>(lock);
+	    void trace(TraceOp const op, uint16_t const arg0 = 0,
+		       uint32_t const arg1 = 0) const
+	    {
+		TraceLog::record(op, board, arg0, arg1);
 	    }
 
-	    // Returns the 32-bit, microsecond timestamp. This value
-	    // is assembled from two 16-bit accesses, so we
-	    // encapsulate the access through this method. Since
-	    // accessing half of the timestamp isn't useful, the
-	    // register definitions are local to this function making
-	    // all 32-bit timestamp requests are done through ths
-	    // method.
+	    // Writes one trigger table entry, keeping the shadow copy
+	    // in step.
 
-	    uint32_t getFtpTimestamp(LockType const& lock) {
-		typedef VME::Register<VME::A16, uint16_t, 0x46, VME::Read, VME::NoWrite> regFtpTSLow;
-		typedef VME::Register<VME::A16, uint16_t, 0x48, VME::Read, VME::NoWrite> regFtpTSHigh;
+	    void writeTrigger(LockType const& lock, uint8_t const event,
+			      uint16_t const value)
+	    {
+		a32.set_element<regTrigger>(lock, event, value);
+		triggers[event] = value;
+		trace(TraceConfig, event, value);
+	    }
+
+	    // Records a status register latch, and a fault if any of
+	    // the error bits are set.
+
+	    void traceStatus(uint16_t const status) const
+	    {
+		uint16_t const errors = MDatParityError | FIFOUnderflow |
+		    FIFOOverflow | TclkParityError;
+
+		if (UNLIKELY(status & errors))
+		    TraceLog::fault(board, status);
+		else
+		    trace(TraceStatus, 0, status);
+	    }
 
-		uint32_t const tmp = a16.get<regFtpTSLow>(lock);
+	    // Feeds a FIFO entry to the threshold tuner, reprogramming
+	    // the threshold when it asks for a change.
 
-		return (tmp >> 4) + (a16.get<regFtpTSHigh>(lock) << 4);
+	    template <typename Lock, typename M16>
+	    void tune(M16 const& m16, Lock const& lock, FifoEntry const& entry)
+	    {
+		if (tuner.isEnabled() && tuner.observe(entry)) {
+		    m16.template set<regFifoThreshold>(lock, tuner.threshold());
+		    trace(TraceRegWrite, regFifoThreshold::RegOffset,
+			  tuner.threshold());
+		}
 	    }
 
-	    // Sets the FIFO threshold value. Even though the register
-	    // is 16 bits wide, it can only accept a subset of values.
-	    // If the caller provides a bad value, it's a programming
-	    // error.
+	    // Reads one entry from the FIFO through the given view of
+	    // the hardware, using one D32 cycle when the drain path
+	    // allows it. This is shared by tasks and the interrupt
+	    // handler so both feed the threshold tuner.
 
-	    void setFifoThreshold(LockType const& lock, uint8_t const level)
+	    template <typename Lock, typename M16, typename M32,
+		      typename M32D32>
+	    FifoEntry fetch(M16 const& m16, M32 const& m32,
+			    M32D32 const& m32d32, Lock const& lock)
 	    {
-		if (level > 0)
-		    a16.set<regFifoThreshold>(lock, level);
-		else
-		    throw std::logic_error("illegal FIFO threshold value");
+		if (UNLIKELY((m16.template get<regStatus>(lock) & FIFOEmpty) == 0)) {
+		    FifoEntry const entry = wideFifo ?
+			m32d32.template get<regFifoD32>(lock) :
+			m32.template get<regFifo>(lock);
+
+		    trace(TraceRegRead, regFifo::RegOffset, entry.raw());
+		    tune(m16, lock, entry);
+		    return entry;
+		} else
+		    return FifoEntry();
 	    }
 
-	    void setupInterrupt(IntLock const&)
+	    // The interrupt handler. It acknowledges the status
+	    // register, moves the FIFO contents into `pending`,
+	    // stamped with the handler's entry time, and wakes the
+	    // drain task.
+	    //
+	    // On entry, it also reads the FTP timestamp. The entry
+	    // that raised the interrupt is the one that brought the
+	    // FIFO up to the threshold, so the difference between its
+	    // stamp and the FTP timestamp is the interrupt latency,
+	    // measured entirely by the board's clock.
+
+	    void service()
+	    {
+		IntLock const lock;
+		Clock::Ticks const entry = Clock::now();
+		uint32_t const now = ftpTimestamp(isrA16, lock) & ClockModel::STAMP_MASK;
+		size_t const trigger = tuner.isEnabled() ? tuner.threshold() :
+		    (fifoThreshold ? fifoThreshold : 1);
+
+		uint16_t const status = isrA16.get<regStatus>(lock);
+
+		isrA16.set<regStatus>(lock, status);
+		trace(TraceIsrEntry);
+		traceStatus(status);
+
+		Event ev;
+		size_t count = 0;
+
+		ev.isr = entry;
+		while ((ev.entry = fetch(isrA16, isrA32, isrA32d32, lock)).isValid()) {
+		    if (++count == trigger && ev.entry.stamp() <= now && !probing)
+			isrStats.latency.record((now - ev.entry.stamp()) * 1000);
+		    pending.push(ev);
+		}
+
+		lastIsr = entry;
+		ready.raise();
+
+		// The calibration's injected interrupts carry no
+		// entries; they'd skew the statistics, so only real
+		// ones are counted.
+
+		if (probing)
+		    probe.raise();
+		else {
+		    ++interrupts;
+		    isrStats.batch.record(count);
+		    isrStats.duration.record(Clock::toNanoseconds(Clock::now() - entry));
+		}
+		trace(TraceIsrExit, 0, count);
+	    }
+
+	    static void isr(HW*);
+
+	    // Publishes an event to the virtual FIFO of every trigger
+	    // bit its event activates.
+
+	    void route(Event const& ev)
 	    {
+		unsigned bits = triggers[ev.entry.event()] & 0xff;
+
+		while (bits) {
+		    demux[__builtin_ctz(bits)]->publish(board, ev);
+		    bits &= bits - 1;
+		}
 	    }
 
+	 public:
 	    // Associates an incoming event with a trigger. The
 	    // parameter `enable` enables or disables the trigger
 	    // level. `event` is the event (0 to 255). `trigBit` is
@@ -229,6 +2259,8 @@ namespace IPUCD {
 				     uint8_t const event,
 				     uint8_t const trigBit)
 	    {
+		IPUCD_LOCK_SITE(lock, SiteAdjustTclkReception);
+
 		if (trigBit > 7)
 		    throw std::logic_error("illegal trigger bit value");
 
@@ -238,7 +2270,7 @@ namespace IPUCD {
 		uint16_t const prev = a32.get_element<regTrigger>(lock, event);
 		uint16_t const value = enable ? (prev | mask) : (prev & ~mask);
 
-		a32.set_element<regTrigger>(lock, event, value);
+		writeTrigger(lock, event, value);
 	    }
 
 	    // Returns `true` or `false` based whether the specified
@@ -248,6 +2280,8 @@ namespace IPUCD {
 				  uint8_t const event,
 				  uint8_t const trigBit)
 	    {
+		IPUCD_LOCK_SITE(lock, SiteGetTclkReception);
+
 		if (trigBit > 7)
 		    throw std::logic_error("illegal trigger bit value");
 
@@ -256,16 +2290,78 @@ namespace IPUCD {
 		return (a32.get_element<regTrigger>(lock, event) & mask) != 0;
 	    }
 
+	    // Returns the set of events which activate trigger bit
+	    // `trigBit`. The answer comes from the shadow table, so no
+	    // VME cycles are spent.
+
+	    EventSet getTriggerMask(LockType const& lock,
+				    uint8_t const trigBit) const
+	    {
+		IPUCD_LOCK_SITE(lock, SiteGetTclkReception);
+
+		if (trigBit > 7)
+		    throw std::logic_error("illegal trigger bit value");
+
+		EventSet set;
+		uint16_t const mask = 1 << trigBit;
+
+		for (size_t ii = 0; ii < regTrigger::RegEntries; ++ii)
+		    if (triggers[ii] & mask)
+			set.set(ii);
+		return set;
+	    }
+
+	    // The inverse view of `getTriggerMask()`: fills `bits` with
+	    // the trigger bits each event activates (bit N set means
+	    // trigger bit N). Also served from the shadow table.
+
+	    void getTriggerMatrix(LockType const& lock,
+				  uint8_t (&bits)[regTrigger::RegEntries]) const
+	    {
+		IPUCD_LOCK_SITE(lock, SiteGetTclkReception);
+
+		for (size_t ii = 0; ii < regTrigger::RegEntries; ++ii)
+		    bits[ii] = triggers[ii] & 0xff;
+	    }
+
+	    // Reloads the shadow table from the hardware in a single
+	    // pass. Only needed if something other than this driver
+	    // may have written the table; returns the number of
+	    // entries that disagreed with the shadow.
+
+	    size_t refreshTriggers(LockType const& lock)
+	    {
+		IPUCD_LOCK_SITE(lock, SiteGetTclkReception);
+
+		size_t stale = 0;
+
+		for (size_t ii = 0; ii < regTrigger::RegEntries; ++ii) {
+		    uint16_t const value =
+			a32.get_element<regTrigger>(lock, ii);
+
+		    if (value != triggers[ii]) {
+			triggers[ii] = value;
+			++stale;
+		    }
+		}
+		trace(TraceRegRead, regTrigger::RegOffset, stale);
+		return stale;
+	    }
+
+	 private:
 	    // Sets the trigger which resets the timestamp used to tag
 	    // events in the FIFO.
 
 	    void setResetFifoTimestampTrigger(LockType const& lock,
 					      uint8_t const trigBit)
 	    {
+		IPUCD_LOCK_SITE(lock, SiteFifoTriggers);
+
 		if (trigBit < 1 || trigBit > 7)
 		    throw std::logic_error("illegal trigger bit value");
 
 		a16.set<regFifoClear>(lock, trigBit + 1);
+		trace(TraceRegWrite, regFifoClear::RegOffset, trigBit + 1);
 	    }
 
 	    // Sets the trigger which writes to the FIFO.
@@ -273,33 +2369,274 @@ namespace IPUCD {
 	    void setWriteFifoTrigger(LockType const& lock,
 				     uint8_t const trigBit)
 	    {
+		IPUCD_LOCK_SITE(lock, SiteFifoTriggers);
+
 		if (trigBit < 1 || trigBit > 7)
 		    throw std::logic_error("illegal trigger bit value");
 
 		a16.set<regFifoWrite>(lock, trigBit + 1);
+		trace(TraceRegWrite, regFifoWrite::RegOffset, trigBit + 1);
 	    }
 
 	    Status getStatus(LockType const& lock)
 	    {
+		IPUCD_LOCK_SITE(lock, SiteGetStatus);
+
 		uint16_t const temp = a16.get<regStatus>(lock);
 
 		a16.set<regStatus>(lock, temp);
+		traceStatus(temp);
 		return Status(temp);
 	    }
 
 	    // Returns the oldest entry in the FIFO. If the FIFO is
 	    // empty, it returns an invalid value which can be tested
-	    // using the `.isValid()` method.
+	    // using the `.isValid()` method. In interrupt mode,
+	    // entries already moved out of the FIFO by the handler
+	    // are returned first.
 
 	 public:
 	    FifoEntry readFifo(LockType const& lock)
 	    {
-		if (UNLIKELY((a16.get<regStatus>(lock) & FIFOEmpty) == 0))
-		    return a32.get<regFifo>(lock);
-		else
-		    return FifoEntry();
+		IPUCD_LOCK_SITE(lock, SiteReadFifo);
+		IPUCD_NO_HEAP;
+
+		Event ev;
+
+		if (UNLIKELY(pending.pop(ev)))
+		    return ev.entry;
+		return fetch(a16, a32, a32d32, lock);
+	    }
+
+	    // Sets the FIFO threshold value. Even though the register
+	    // is 16 bits wide, it can only accept a subset of values.
+	    // If the caller provides a bad value, it's a programming
+	    // error. Setting the threshold by hand turns off automatic
+	    // tuning.
+
+	    void setFifoThreshold(LockType const& lock, uint8_t const level)
+	    {
+		IPUCD_LOCK_SITE(lock, SiteFifoThreshold);
+
+		if (level > 0) {
+		    a16.set<regFifoThreshold>(lock, level);
+		    trace(TraceRegWrite, regFifoThreshold::RegOffset, level);
+		    fifoThreshold = level;
+		    tuner = ThresholdTuner();
+		} else
+		    throw std::logic_error("illegal FIFO threshold value");
+	    }
+
+	    // Lets the driver pick the FIFO threshold. `maxLatency` is
+	    // the longest time, in microseconds, an entry may wait in
+	    // the FIFO for the threshold to be reached. `maxThreshold`
+	    // caps the threshold, which bounds the batch size handed
+	    // to the reader. The threshold starts at 1 and follows the
+	    // event rate as entries are read.
+	    //
+	    // The estimate only moves when entries are read, so a
+	    // reader that depends on the threshold interrupt should
+	    // still poll at least every `maxLatency` microseconds to
+	    // pick up a partial batch after the rate drops.
+
+	    void enableThresholdTuning(LockType const& lock,
+				       uint32_t const maxLatency,
+				       uint8_t const maxThreshold = 0xff)
+	    {
+		IPUCD_LOCK_SITE(lock, SiteFifoThreshold);
+
+		if (maxLatency == 0)
+		    throw std::logic_error("illegal FIFO latency budget");
+
+		tuner = ThresholdTuner(maxLatency, maxThreshold);
+		a16.set<regFifoThreshold>(lock, tuner.threshold());
+		trace(TraceRegWrite, regFifoThreshold::RegOffset,
+		      tuner.threshold());
+	    }
+
+	    // Returns the tuner's rate estimate and most recent
+	    // decision. If tuning is disabled, the counters are zero.
+
+	    ThresholdTuner::Metrics
+	    getThresholdMetrics(LockType const& lock) const
+	    {
+		IPUCD_LOCK_SITE(lock, SiteFifoThreshold);
+
+		return tuner.metrics();
+	    }
+
+	    // Reads up to `n` entries from the FIFO into `buf` and
+	    // returns how many were read. If event timing is enabled,
+	    // each event gets its drain time and, after the batch, the
+	    // clock model is anchored with one FTP timestamp read so
+	    // the hardware stamps can be placed on the host timeline.
+
+	    size_t drain(LockType const& lock, Event* const buf,
+			 size_t const n)
+	    {
+		IPUCD_LOCK_SITE(lock, SiteDrain);
+		IPUCD_NO_HEAP;
+
+		size_t total = 0;
+
+		trace(TraceDrainBegin, 0, n);
+		while (total < n && pending.pop(buf[total])) {
+		    buf[total].drained = timing ? Clock::now() : 0;
+		    buf[total++].arrived = 0;
+		}
+
+#ifdef IPUCD_BUS_TRACE
+		if (drainPath == DrainBlock && BusTrace::mode == BusTrace::Off)
+#else
+		if (drainPath == DrainBlock)
+#endif
+		    total += blockDrain(lock, buf + total, n - total);
+
+		while (total < n) {
+		    FifoEntry const entry = readFifo(lock);
+
+		    if (!entry.isValid())
+			break;
+
+		    Event& ev = buf[total++];
+
+		    ev.entry = entry;
+		    ev.isr = 0;
+		    ev.drained = timing ? Clock::now() : 0;
+		    ev.arrived = 0;
+		}
+
+		if (timing && total > 0) {
+		    Clock::Ticks const before = Clock::now();
+		    uint32_t const stamp = getFtpTimestamp(lock);
+		    Clock::Ticks const after = Clock::now();
+
+		    clock.anchor(before + (after - before) / 2, stamp);
+		    for (size_t ii = 0; ii < total; ++ii)
+			buf[ii].arrived = clock.toHost(buf[ii].entry.stamp());
+		}
+
+		if (demux[0])
+		    for (size_t ii = 0; ii < total; ++ii)
+			route(buf[ii]);
+
+		if (!schedule.empty())
+		    runTriggerSchedule(lock);
+
+		trace(TraceDrainEnd, 0, total);
+		return total;
+	    }
+
+	    // Enables or disables host timestamps on drained events.
+
+	    void setEventTiming(LockType const& lock, bool const enable)
+	    {
+		IPUCD_LOCK_SITE(lock, SiteDrain);
+
+		timing = enable;
+	    }
+
+	    ClockModel getClockModel(LockType const& lock) const
+	    {
+		IPUCD_LOCK_SITE(lock, SiteDrain);
+
+		return clock;
 	    }
 
+	    // Connects the interrupt handler to `vector` and switches
+	    // the driver to interrupt mode. The carrier has to be set
+	    // up to supply the vector and enable its interrupt level.
+	    // `depth` sizes the queue between the handler and the
+	    // drain task. Hosted builds have no interrupt controller;
+	    // there the handler is only run by `calibrate()`.
+
+	    void enableInterrupts(LockType const& lock, int const vector,
+				  size_t const depth = 1024);
+
+	    // Blocks until the interrupt handler has queued events,
+	    // or the timeout (in milliseconds) expires.
+
+	    bool waitForEvents(uint32_t const timeout)
+	    {
+		return ready.wait(timeout);
+	    }
+
+	    // Returns a copy of the interrupt handler's statistics.
+	    // Holding the lock keeps the handler from updating them
+	    // during the copy.
+
+	    IsrStats getIsrStats(LockType const& lock) const
+	    {
+		IPUCD_LOCK_SITE(lock, SiteInterrupts);
+
+		return isrStats;
+	    }
+
+	    // Creates a virtual FIFO for each trigger bit. From then
+	    // on, `drain()` routes each event, using the shadow of the
+	    // trigger table, into the virtual FIFO of every trigger
+	    // bit it activates. `depth` is the number of events each
+	    // one holds and must be a power of two.
+
+	    void enableTriggerDemux(LockType const& lock, size_t const depth);
+
+	    // Returns the virtual FIFO of `trigBit`. Follow it with a
+	    // `BroadcastCursor`.
+
+	    BroadcastRing const& getTriggerQueue(uint8_t const trigBit) const
+	    {
+		if (trigBit > 7)
+		    throw std::logic_error("illegal trigger bit value");
+		if (!demux[trigBit])
+		    throw std::logic_error("trigger demultiplexing not enabled");
+		return *demux[trigBit];
+	    }
+
+	    // Loads a trigger schedule. It's compiled against the
+	    // current trigger table, the supercycle's start state is
+	    // written immediately and the remaining writes are made by
+	    // `runTriggerSchedule()`, at most `batch` per call so they
+	    // fit between events. An empty schedule unloads the
+	    // current one (the table keeps its last state).
+
+	    void loadTriggerSchedule(LockType const& lock,
+				     TriggerSchedule const& sched,
+				     size_t const batch = 8);
+
+	    // Makes the schedule writes which are due. The current
+	    // hardware stamp comes from the clock model when event
+	    // timing is on, else from the board. `drain()` calls this
+	    // after each batch; pollers which don't drain can call it
+	    // directly. Returns the number of writes made.
+
+	    size_t runTriggerSchedule(LockType const& lock);
+
+	    // Asks the board to generate an interrupt through the
+	    // `SW_Interrupt` control command. The handler runs once
+	    // the lock is released.
+
+	    void generateInterrupt(LockType const& lock)
+	    {
+		IPUCD_LOCK_SITE(lock, SiteCalibrate);
+
+		a16.set<regControl>(lock, SW_Interrupt);
+		trace(TraceRegWrite, regControl::RegOffset, SW_Interrupt);
+	    }
+
+	    // Measures the driver's interrupt path. Each of `count`
+	    // iterations issues `SW_Interrupt` at a known host time
+	    // and then waits, like a drain task, for the handler to
+	    // signal. The command-to-handler, handler-to-task and
+	    // total latencies are collected into histograms. Any
+	    // task blocked in `waitForEvents()` is still woken, but
+	    // should be idle during the run. Hosted builds have no
+	    // interrupt controller, so the handler is called directly
+	    // after the command is written and only the software
+	    // path is measured. Interrupts have to be enabled first.
+
+	    Calibration calibrate(size_t const count,
+				  uint32_t const timeout = 100);
+
 	public:
 	    // Creates an instance of the driver and initializes the
 	    // associated hardware. If this constructor completes
@@ -308,15 +2645,32 @@ namespace IPUCD {
 	    // untouched.
 
 	    HW(size_t const a16_offset, size_t const a32_offset)
-		: a16(a16_offset), a32(a32_offset)
+		: a16(a16_offset), a32(a32_offset), a32d32(a32_offset),
+		  board(uint8_t(a16_offset >> 8)), drainPath(DrainD16),
+		  wideFifo(false), timing(false), fifoThreshold(0),
+		  fifoAddr(uint32_t(a32_offset + regFifo::RegOffset)),
+		  blockRead(0), blockCtx(0), scheduleBatch(0),
+		  isrA16(a16_offset), isrA32(a32_offset),
+		  isrA32d32(a32_offset), interruptMode(false),
+		  probing(false), interrupts(0), lastIsr(0)
 	    {
+		for (size_t ii = 0; ii < 8; ++ii)
+		    demux[ii] = 0;
+		blockStats.transfers = blockStats.entries =
+		    blockStats.failures = blockStats.empty = 0;
+
 		LockType const lock(this);
 
-		// Look for the IP-UCD module ID.
+		// Look for the IP-UCD module ID and find out what this
+		// revision supports.
 
-		if (getModuleId(lock) != 0xbb15)
+		identity = readIdentity(lock);
+		if (identity.moduleId() != 0xbb15)
 		    throw std::runtime_error("IP-UCD not found at A16 offset");
 
+		caps = lookupCapabilities(identity);
+		selectDrainPath();
+
 		// Perform a software reset.
 
 		a16.set<regControl>(lock, SW_Reset);
@@ -326,15 +2680,422 @@ namespace IPUCD {
 		a16.set<regFifoWrite>(lock, 0x00);
 		a16.set<regFifoClear>(lock, 0x00);
 
-		for (size_t ii = 0; ii < regTrigger::RegEntries; ++ii)
+		for (size_t ii = 0; ii < regTrigger::RegEntries; ++ii) {
 		    a32.set_element<regTrigger>(lock, ii, 0x00);
+		    triggers[ii] = 0x00;
+		}
 
 		// Start collecting TCLK events.
 
 		a16.set<regControl>(lock, EnableTCLK);
 	    }
+
+	    Identity getIdentity() const { return identity; }
+	    Capabilities getCapabilities() const { return caps; }
+	    DrainPath getDrainPath() const { return drainPath; }
+
+	    // Installs the carrier's block-transfer routine. `drain()`
+	    // uses it, when the board supports block transfers, to
+	    // recover from backlogs quickly. The board doesn't report
+	    // how full its FIFO is, so blocks are only read while the
+	    // threshold status bit is set, and are the size of the
+	    // threshold: with no threshold set (or one below 2) every
+	    // entry is read singly. Off-target, a null `fn` installs
+	    // an emulation so the path can be exercised.
+
+	    void enableBlockDrain(LockType const& lock, BlockRead fn,
+				  void* ctx);
+
+	    BlockStats getBlockStats(LockType const& lock) const
+	    {
+		IPUCD_LOCK_SITE(lock, SiteDrain);
+
+		return blockStats;
+	    }
+
+	    // Replaces the capabilities found in the table, for
+	    // trying a new board revision before adding it there.
+
+	    void setCapabilities(LockType const& lock, Capabilities const& c)
+	    {
+		IPUCD_LOCK_SITE(lock, SiteInit);
+
+		caps = c;
+		selectDrainPath();
+	    }
+
+	    ~HW();
+	};
+
+	// Writes a Chrome trace-event JSON file, which can be loaded
+	// by chrome://tracing and Perfetto. Each board becomes a
+	// process with tracks for its TCLK events (instants), its
+	// supercycles (slices between timestamp resets), the drain
+	// task and the interrupt handler (duration slices). Times
+	// are in microseconds from the first host timestamp written.
+	//
+	// Events carrying host times (see `HW::drain()`) and trace
+	// records share the host timeline. Raw captures only have
+	// hardware stamps, so they're laid out on their own timeline
+	// with supercycles placed back to back.
+
+	class ChromeTrace {
+	    FILE* const fp;
+	    bool first;
+	    Clock::Ticks origin;
+	    uint32_t named[8];
+
+	    ChromeTrace(ChromeTrace const&);
+	    ChromeTrace& operator=(ChromeTrace const&);
+
+	    double toUs(Clock::Ticks t, uint32_t freq);
+	    void begin(char const* ph, unsigned pid, unsigned tid, double ts);
+	    void name(unsigned pid, char const* process);
+	    void supercycle(unsigned pid, double start, double dur,
+			    unsigned cycle);
+
+	 public:
+	    enum Track { TrackEvents = 1, TrackSupercycles, TrackDrain, TrackIsr };
+
+	    explicit ChromeTrace(char const* file);
+	    ~ChromeTrace();
+
+	    void addTrace(TraceRecord const* rec, size_t n, uint32_t freq);
+	    void addEvents(uint8_t board, Event const* ev, size_t n);
+	    void addCapture(uint8_t board, FifoEntry const* entry, size_t n);
+
+	    // Converts a trace log written by `TraceLog::save()`
+	    // and/or a capture file to JSON. Either input may be null.
+	    // A capture file holds raw 32-bit FIFO words, big-endian,
+	    // as read from `board`. Returns `false` if an input can't
+	    // be read.
+
+	    static bool convert(char const* out, char const* traceFile,
+				char const* captureFile, uint8_t board = 0);
+	};
+
+#ifndef __vxworks
+
+	// Streams events from a broadcast ring to other processes
+	// over a Unix domain (stream) socket. A client may send an
+	// `EventSet` (32 bytes) at any time to choose the events it
+	// receives; until then it receives everything. The server
+	// sends frames of:
+	//
+	//   uint32_t length;  // bytes following this field
+	//   uint32_t first;   // sequence number of the oldest event
+	//   uint32_t end;     // one past the newest event
+	//   uint32_t count;   // number of slots in the frame
+	//   uint32_t lost;    // events overwritten before being sent
+	//   BroadcastSlot slots[count];
+	//
+	// in host byte order. Slots are sent straight from the ring
+	// with `sendmsg()`, which copies each one front to back. The
+	// producer may overwrite a slot while it's being sent: the
+	// slot then goes out with a newer `seq` or `check` (or the
+	// complement of one), or with the two differing if the
+	// rewrite overlapped the copy. Clients must drop a slot
+	// unless `seq == check` and `seq` is inside [first, end),
+	// i.e. `seq - first < end - first`.
+
+	class EventServer {
+	    enum { FRAME_WORDS = 5 };
+
+	    struct Client {
+		int fd;
+		uint32_t next;
+		uint32_t lost;
+		EventSet mask;
+		EventSet incoming;
+		size_t maskBytes;
+		std::vector<char> backlog;
+	    };
+
+	    BroadcastRing const& ring;
+	    std::string const path;
+	    int const listener;
+	    std::vector<Client> clients;
+	    size_t const maxBatch;
+	    std::vector<iovec> iov;
+
+	    // The descriptors handed to `poll()`: the listener, then
+	    // one per client. Only `accept()` grows it.
+
+	    std::vector<pollfd> fds;
+
+	    EventServer(EventServer const&);
+	    EventServer& operator=(EventServer const&);
+
+	    void accept();
+	    bool receive(Client&);
+	    bool send(Client&);
+	    bool serve(int timeout);
+
+	 public:
+	    // Listens on `path`, replacing a stale socket file.
+	    // `maxBatch` limits the slots per frame.
+
+	    EventServer(char const* path, BroadcastRing const& ring,
+			size_t maxBatch = 256);
+	    ~EventServer();
+
+	    size_t clientCount() const { return clients.size(); }
+
+	    // Waits up to `timeout` milliseconds for client activity,
+	    // then sends each client the events published since its
+	    // last frame. Call it in a loop from a dedicated thread.
+
+	    void poll(int timeout = 1);
+	};
+
+#endif
+
+	// Runs handlers registered on TCLK events. Each
+	// subscription declares a priority class:
+	//
+	//   HardRealTime: called inline by `dispatch()`, before any
+	//     other class, on the drain task.
+	//   Soft: queued on the subscription's home worker. Workers
+	//     run these ahead of anything else.
+	//   Bulk: collected by `dispatch()` and handed to a shared
+	//     queue in batches. Workers take them only when no soft
+	//     work is left.
+	//
+	// Workers are tasks (pthreads on the host), each optionally
+	// pinned to a CPU. Idle workers steal soft jobs from the far
+	// end of busy workers' queues, so a slow handler only holds
+	// up the jobs queued behind it. Handlers are registered
+	// before `start()`; a job is dropped (and counted) if its
+	// queue is full.
+	//
+	// Because of stealing and the shared bulk queue, a Soft or
+	// Bulk handler may run on several workers at once and see
+	// its events out of order: a thief takes the newest job
+	// while the home worker is still working through older
+	// ones. These handlers must be reentrant and must not rely
+	// on event order; use `Event::arrived` or the FIFO stamp to
+	// order them. Only HardRealTime handlers are called
+	// serially, in drain order.
+
+	class Executor {
+	 public:
+	    typedef void (*Handler)(Event const&, void*);
+
+	    enum Priority { HardRealTime, Soft, Bulk, PRIORITIES };
+
+	    struct Stats {
+		uint32_t executed;
+		uint32_t stolen;
+		uint32_t bulk;
+		uint32_t dropped;
+	    };
+
+	 private:
+	    struct Job {
+		Handler fn;
+		void* arg;
+		Event ev;
+	    };
+
+	    struct Subscription {
+		Handler fn;
+		void* arg;
+		size_t home;
+	    };
+
+	    // A bounded job FIFO which can also be popped from the
+	    // back, for stealing. The capacity is rounded up to a
+	    // power of two.
+
+	    struct JobQueue {
+		Mutex mutex;
+		std::vector<Job> job;
+		size_t mask;
+		size_t head;
+		size_t tail;
+		uint32_t dropped;
+
+		explicit JobQueue(size_t);
+
+		size_t push(Job const*, size_t);
+		bool popFront(Job&);
+		bool popBack(Job&);
+	    };
+
+	    struct Worker {
+		Executor* owner;
+		size_t index;
+		int cpu;
+		JobQueue queue;
+		Signal wake;
+		Signal done;
+		bool volatile idle;
+		Stats stats;
+		LatencyStats latency;
+#ifdef __vxworks
+		int tid;
+#else
+		pthread_t thread;
+#endif
+
+		Worker(Executor*, size_t, int, size_t);
+	    };
+
+	    std::vector<Worker*> worker;
+	    std::vector<Subscription> subs[PRIORITIES][256];
+	    size_t subscriptions;
+	    int const priority;
+	    bool volatile running;
+
+	    // Bulk jobs are staged here by the dispatching task and
+	    // moved to `bulk` a batch at a time.
+
+	    JobQueue bulk;
+	    std::vector<Job> staged;
+	    size_t const bulkBatch;
+	    uint32_t inlined;
+
+	    // Delivery latencies of the hard real-time handlers, which
+	    // run on the dispatching task.
+
+	    LatencyStats inlineLatency;
+
+	    Executor(Executor const&);
+	    Executor& operator=(Executor const&);
+
+#ifdef __vxworks
+	    static int entry(Worker*);
+#else
+	    static void* entry(void*);
+#endif
+	    void run(Worker&);
+	    bool steal(size_t, Job&);
+	    void halt(size_t);
+	    void wakeHelper(Worker const&);
+	    void hard(Event const&);
+	    void soft(Event const&);
+	    void stage(Event const&);
+
+	    // Records the drain-to-subscriber stages of a timed event
+	    // as its handler is called.
+
+	    static void delivering(LatencyStats& stats, Event const& ev)
+	    {
+		if (ev.drained || ev.arrived)
+		    stats.delivered(ev);
+	    }
+
+	 public:
+	    // Creates one worker per entry of `cpus`; a negative entry
+	    // leaves that worker unpinned. `depth` is the size of each
+	    // worker's queue and of the bulk queue, `bulkBatch` the
+	    // number of bulk jobs handed over at once and `priority`
+	    // the VxWorks task priority of the workers.
+
+	    explicit Executor(std::vector<int> const& cpus,
+			      size_t depth = 256, int priority = 60,
+			      size_t bulkBatch = 32);
+	    ~Executor();
+
+	    size_t workers() const { return worker.size(); }
+
+	    // Runs `fn(ev, arg)` for each dispatched event `ev` whose
+	    // event number is `event`, in priority class `cls`. Soft
+	    // handlers are spread over the workers in the order
+	    // they're registered.
+
+	    void subscribe(uint8_t event, Handler fn, void* arg = 0,
+			   Priority cls = Soft);
+
+	    void start();
+	    void stop();
+
+	    // Dispatches one event. Bulk jobs stay staged until a
+	    // batch fills or `flush()` is called.
+
+	    void dispatch(Event const& ev)
+	    {
+		IPUCD_NO_HEAP;
+
+		hard(ev);
+		soft(ev);
+		stage(ev);
+	    }
+
+	    // Dispatches a drained batch: every hard real-time
+	    // handler runs before any soft job is queued, and the
+	    // bulk jobs are flushed at the end.
+
+	    void dispatch(Event const* buf, size_t n);
+
+	    void flush();
+
+	    Stats stats(size_t const w) const
+	    {
+		Stats s = worker.at(w)->stats;
+
+		s.dropped = worker[w]->queue.dropped;
+		return s;
+	    }
+
+	    uint32_t inlineCount() const { return inlined; }
+	    uint32_t bulkDropped() const { return bulk.dropped; }
+
+	    // Returns the delivery latencies of every handler call
+	    // so far, merged from the workers and the dispatching
+	    // task. Only the stages from the drain task on are
+	    // filled. Taken while handlers run, it's a snapshot
+	    // that may miss the samples being recorded.
+
+	    LatencyStats latency() const;
+	    void dump() const;
 	};
 
+	// Keeps only the latest occurrence of each subscribed event,
+	// for consumers like displays which don't need every one.
+	// `update()` overwrites the event's slot and marks it dirty;
+	// `read()` returns everything that changed since the last
+	// call with one scan of the dirty bitmap. Memory and work are
+	// bounded by the 256 slots however long the consumer sleeps.
+
+	class CoalescingSubscription {
+	    Mutex mutex;
+	    EventSet subscribed;
+	    EventSet dirty;
+	    Event slot[256];
+	    uint32_t updates;
+	    uint32_t coalesced;
+
+	    CoalescingSubscription(CoalescingSubscription const&);
+	    CoalescingSubscription& operator=(CoalescingSubscription const&);
+
+	    static void handler(Event const&, void*);
+
+	 public:
+	    explicit CoalescingSubscription(EventSet const& events) :
+		subscribed(events), updates(0), coalesced(0)
+	    {
+	    }
+
+	    // Registers `update()` as a hard real-time handler of each
+	    // subscribed event; it's cheap enough to run inline.
+
+	    void attach(Executor&);
+
+	    void update(Event const&);
+
+	    // Copies the events which changed since the last call into
+	    // `buf` (at most 256), in event number order, and clears
+	    // their dirty bits. Returns the number copied.
+
+	    size_t read(Event* buf);
+
+	    // Returns the number of updates, and of those which
+	    // replaced an event the consumer never read.
+
+	    uint32_t updateCount() const { return updates; }
+	    uint32_t coalescedCount() const { return coalesced; }
+	};
     }
 }
 